@@ -187,13 +187,47 @@ Key can be either a keysym symbol or a base character code."
       (put key 'ascii-character code))
   (define-key function-key-map (vector (if shifts (append shifts (list key)) key)) (vector code)))
 
+;;; Decode whole keysym sequences at once, from tables made ahead of
+;;; time by `lmkbd-decode-generate'.  Sequences with other modifiers
+;;; than Shift are not in them, and fall through to the C-x @ bindings
+;;; of `function-key-map' above.
+
+(defvar lmkbd-decode-installed nil
+  "Whether `lmkbd-graphic-map' is already under `function-key-map'.")
+
+(defun lmkbd-decode-install-terminal (&optional frame)
+  "Put `lmkbd-decode-map' in the `input-decode-map' of FRAME's terminal."
+  (with-selected-frame (or frame (selected-frame))
+    (define-key input-decode-map [?\C-x ?@] lmkbd-decode-map)
+    (define-key input-decode-map [?\C-x ?\"] lmkbd-decode-map)))
+
+(defun lmkbd-install-decode-map ()
+  "Use the generated lmkbd-decode tables, if they have been made.
+Returns nil if not, so that the keysyms are bound one at a time instead."
+  (when (load (expand-file-name "lmkbd-decode" lmkbd-directory) t t)
+    (unless lmkbd-decode-installed
+      (dolist (key lmkbd-graphic-keysyms)
+        (put (car key) 'ascii-character (cadr key)))
+      (set-keymap-parent function-key-map
+                         (make-composed-keymap lmkbd-graphic-map
+                                               (keymap-parent function-key-map)))
+      (setq lmkbd-decode-installed t))
+    ;; `input-decode-map' belongs to each terminal.
+    (lmkbd-decode-install-terminal)
+    (add-hook 'tty-setup-hook #'lmkbd-decode-install-terminal)
+    (add-hook 'after-make-frame-functions #'lmkbd-decode-install-terminal)
+    t))
+
 )
 )
 
 ;; Some of these Unicode characters do not correspond to anything in a
 ;; character set that un-define knows about.  They get lost when this
-;; file is loaded.
-(dolist (key '((alpha #x03B1 #x0391)    ;α Α
+;; file is loaded.  The firmware's Unicode mode table is generated
+;; from this one by src/unicode-keysyms.awk, so keep to one entry per
+;; line.
+(defconst lmkbd-graphic-keysyms
+             '((alpha #x03B1 #x0391)    ;α Α
                (approximate #x2248)     ;≈
                (atsign #x0040 #x0060)   ;@ `
                (backslash #x005C #x007B) ;\ {
@@ -299,13 +333,99 @@ Key can be either a keysym symbol or a base character code."
                (apliota #x2373)         ;⍳
                (aplomega #x2375)        ;⍵
                (aplrho #x2374)          ;⍴
-               ))
-  (let ((keysym (car key))
-        (code (cadr key))
-        (shifted-code (car (cddr key))))
-    (lmkbd-graphic-unicode keysym nil code)
-    (if shifted-code
-        (lmkbd-graphic-unicode keysym '(shift) shifted-code))))
+               )
+  "Keysyms of graphic legends: keysym, Unicode code and, if any, code with shift.")
+
+;; The other keysyms the keyboard sends, which stay as function keys.
+(defconst lmkbd-function-keysyms
+  '(abort altmode backnext boldlock break call clear clearinput clearscreen
+    complete escape form function handleft handright help holdoutput i ii iii
+    itallock iv left line local macro middle network page quote refresh resume
+    right scroll select square status stopoutput suspend system terminal
+    thumbdown thumbup triangle undo vt)
+  "Keysyms without a Unicode character.")
+
+(defconst lmkbd-directory
+  (file-name-directory (or load-file-name buffer-file-name default-directory)))
+
+(defun lmkbd-decode-sequence (keysym &optional shift)
+  "The events the keyboard sends for KEYSYM in Emacs mode, possibly with SHIFT."
+  (vconcat [?\C-x ?@ ?q] (if shift [?\C-x ?@ ?S]) [?\C-x ?@ ?k]
+           (symbol-name keysym) [?\r]))
+
+(defun lmkbd-decode-bindings ()
+  "Each keysym sequence decoded by `lmkbd-decode-map', with what it decodes to."
+  (let (bindings)
+    (dolist (key lmkbd-graphic-keysyms)
+      (push (cons (lmkbd-decode-sequence (car key)) (vector (cadr key))) bindings)
+      (if (nth 2 key)
+          (push (cons (lmkbd-decode-sequence (car key) t) (vector (nth 2 key)))
+                bindings)))
+    (dolist (keysym lmkbd-function-keysyms)
+      (push (cons (lmkbd-decode-sequence keysym) (vector keysym)) bindings)
+      (push (cons (lmkbd-decode-sequence keysym t)
+                  (vector (event-convert-list (list 'shift keysym))))
+            bindings))
+    (nreverse bindings)))
+
+(defun lmkbd-decode-generate (&optional file)
+  "Write the keysym decoding tables to FILE, by default lmkbd-decode.el here,
+and byte-compile it, so that they load in one step.  See emacs/Makefile."
+  (interactive)
+  (let ((file (or file (expand-file-name "lmkbd-decode.el" lmkbd-directory)))
+        (decode-map (make-sparse-keymap))
+        (graphic-map (make-sparse-keymap)))
+    ;; One trie of every sequence after C-x @, ending in RET from a
+    ;; terminal or <return> from a window system.
+    (dolist (binding (lmkbd-decode-bindings))
+      (let ((keys (substring (car binding) 2 -1)))
+        (define-key decode-map (vconcat keys [?\r]) (cdr binding))
+        (define-key decode-map (vconcat keys [return]) (cdr binding))))
+    ;; Keysyms themselves, as from `synthesize-keysym' or an XKB layout.
+    (dolist (key lmkbd-graphic-keysyms)
+      (define-key graphic-map (vector (car key)) (vector (cadr key)))
+      (if (nth 2 key)
+          (define-key graphic-map (vector (list 'shift (car key))) (vector (nth 2 key)))))
+    (with-temp-file file
+      (let ((print-length nil)
+            (print-level nil)
+            (print-escape-nonascii t))
+        (insert ";;; lmkbd-decode.el --- generated by `lmkbd-decode-generate'; do not edit.  -*- lexical-binding: t -*-\n\n")
+        (insert "(defconst lmkbd-decode-map\n  '")
+        (prin1 decode-map (current-buffer))
+        (insert "\n  \"Keysym sequences after C-x @, for `input-decode-map'.\")\n\n")
+        (insert "(defconst lmkbd-graphic-map\n  '")
+        (prin1 graphic-map (current-buffer))
+        (insert "\n  \"Graphic keysyms, for `function-key-map'.\")\n\n")
+        (insert "(provide 'lmkbd-decode)\n")))
+    (byte-compile-file file)))
+
+(defun lmkbd-decode-benchmark (&optional repetitions)
+  "Time `read-key-sequence' on every keysym sequence the keyboard sends,
+REPETITIONS times (10 by default, or the prefix argument)."
+  (interactive "P")
+  (let* ((bindings (lmkbd-decode-bindings))
+         (repetitions (if repetitions (prefix-numeric-value repetitions) 10))
+         (wrong 0)
+         (time (car (benchmark-run repetitions
+                      (dolist (binding bindings)
+                        (setq unread-command-events (append (car binding) nil))
+                        (unless (equal (read-key-sequence nil) (cdr binding))
+                          (setq wrong (1+ wrong)
+                                unread-command-events nil))))))
+         (count (* repetitions (length bindings))))
+    (message "%d sequences in %.3fs, %.0fus each; %d decoded wrongly."
+             count time (/ (* time 1e6) count) wrong)))
+
+(unless (and (fboundp 'lmkbd-install-decode-map)
+             (lmkbd-install-decode-map))
+  (dolist (key lmkbd-graphic-keysyms)
+    (let ((keysym (car key))
+          (code (cadr key))
+          (shifted-code (car (cddr key))))
+      (lmkbd-graphic-unicode keysym nil code)
+      (if shifted-code
+          (lmkbd-graphic-unicode keysym '(shift) shifted-code)))))
 
 (dolist (key '((clearscreen [(control ?l)])
                (clearinput [(control ?0) (control ?k)])
@@ -49,6 +49,9 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM KeyboardReport[] =
   HID_RI_USAGE_PAGE(8, 0x01),
   HID_RI_USAGE(8, 0x06),
   HID_RI_COLLECTION(8, 0x01),
+#ifdef LMKBD_CONSUMER_KEYS
+  HID_RI_REPORT_ID(8, REPORT_ID_KEYBOARD),
+#endif
   HID_RI_USAGE_PAGE(8, 0x07),
   HID_RI_USAGE_MINIMUM(8, 0xE0),
   HID_RI_USAGE_MAXIMUM(8, 0xE7),
@@ -81,12 +84,52 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM KeyboardReport[] =
   HID_RI_REPORT_COUNT(8, 0x01),
   HID_RI_REPORT_SIZE(8, 0x08),
   HID_RI_USAGE(8, 0x01),
-  HID_RI_FEATURE(8, HID_IOF_CONSTANT | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+  HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_NON_VOLATILE),
   HID_RI_USAGE(8, 0x02),
-  HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+  HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_NON_VOLATILE),
   HID_RI_USAGE(8, 0x03),
-  HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
-  HID_RI_END_COLLECTION(0)
+  HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_NON_VOLATILE),
+  HID_RI_USAGE(8, 0x04),
+  HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_NON_VOLATILE),
+  HID_RI_REPORT_COUNT(8, 0x03),
+  HID_RI_USAGE_MINIMUM(8, 0x05),
+  HID_RI_USAGE_MAXIMUM(8, 0x07),
+  HID_RI_FEATURE(8, HID_IOF_CONSTANT | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_VOLATILE),
+#ifdef FEATURE_PAGES
+  HID_RI_REPORT_COUNT(8, 0x01),
+  HID_RI_USAGE(8, 0x08),
+  HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_VOLATILE),
+  HID_RI_REPORT_COUNT(8, FEATURE_PAGE_SIZE),
+  HID_RI_USAGE(8, 0x09),
+  HID_RI_FEATURE(16, HID_IOF_CONSTANT | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_VOLATILE | HID_IOF_BUFFERED_BYTES),
+#endif
+  HID_RI_END_COLLECTION(0),
+#ifdef LMKBD_CONSUMER_KEYS
+  HID_RI_USAGE_PAGE(8, 0x0C),
+  HID_RI_USAGE(8, 0x01),
+  HID_RI_COLLECTION(8, 0x01),
+  HID_RI_REPORT_ID(8, REPORT_ID_CONSUMER),
+  HID_RI_LOGICAL_MINIMUM(8, 0x00),
+  HID_RI_LOGICAL_MAXIMUM(16, 0x03FF),
+  HID_RI_USAGE_MINIMUM(8, 0x00),
+  HID_RI_USAGE_MAXIMUM(16, 0x03FF),
+  HID_RI_REPORT_COUNT(8, CONSUMER_REPORT_KEYS),
+  HID_RI_REPORT_SIZE(8, 0x10),
+  HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_ARRAY | HID_IOF_ABSOLUTE),
+  HID_RI_END_COLLECTION(0),
+  HID_RI_USAGE_PAGE(8, 0x01),
+  HID_RI_USAGE(8, 0x80),
+  HID_RI_COLLECTION(8, 0x01),
+  HID_RI_REPORT_ID(8, REPORT_ID_SYSTEM),
+  HID_RI_LOGICAL_MINIMUM(8, 0x00),
+  HID_RI_LOGICAL_MAXIMUM(16, 0x00B7),
+  HID_RI_USAGE_MINIMUM(8, 0x00),
+  HID_RI_USAGE_MAXIMUM(16, 0x00B7),
+  HID_RI_REPORT_COUNT(8, 0x01),
+  HID_RI_REPORT_SIZE(8, 0x08),
+  HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_ARRAY | HID_IOF_ABSOLUTE),
+  HID_RI_END_COLLECTION(0),
+#endif
 #endif
 };
 
@@ -112,7 +155,7 @@ const USB_Descriptor_Device_t PROGMEM DeviceDescriptor =
 
   .ManufacturerStrIndex   = STRING_ID_Manufacturer,
   .ProductStrIndex        = STRING_ID_Product,
-  .SerialNumStrIndex      = NO_DESCRIPTOR,
+  .SerialNumStrIndex      = USE_INTERNAL_SERIAL,
 
   .NumberOfConfigurations = FIXED_NUM_CONFIGURATIONS
 };
@@ -134,7 +177,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
       .ConfigurationNumber    = 1,
       .ConfigurationStrIndex  = NO_DESCRIPTOR,
 
-      .ConfigAttributes       = (USB_CONFIG_ATTR_RESERVED | USB_CONFIG_ATTR_SELFPOWERED),
+      .ConfigAttributes       = (USB_CONFIG_ATTR_RESERVED | USB_CONFIG_ATTR_SELFPOWERED | USB_CONFIG_ATTR_REMOTEWAKEUP),
 
       .MaxPowerConsumption    = USB_CONFIG_POWER_MA(100)
     },
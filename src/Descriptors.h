@@ -77,8 +77,41 @@ enum StringDescriptors_t
 /** Endpoint address of the Keyboard HID reporting IN endpoint. */
 #define KEYBOARD_EPADDR              (ENDPOINT_DIR_IN | 1)
 
-/** Size in bytes of the Keyboard HID reporting IN endpoint. */
+/** Report IDs, when there are Consumer and System Control reports
+ *  besides the keyboard's; otherwise reports have no ID.
+ */
+#ifdef LMKBD_CONSUMER_KEYS
+#define REPORT_ID_KEYBOARD           1
+#define REPORT_ID_CONSUMER           2
+#define REPORT_ID_SYSTEM             3
+#endif
+
+/** Number of usages at once in the Consumer report. */
+#define CONSUMER_REPORT_KEYS         2
+
+/** Size in bytes of the Keyboard HID reporting IN endpoint, enough for a report ID as well. */
+#ifdef LMKBD_CONSUMER_KEYS
+#define KEYBOARD_EPSIZE              16
+#else
 #define KEYBOARD_EPSIZE              8
+#endif
+
+/** Size in bytes of one page of statistics in the feature report. */
+#define FEATURE_PAGE_SIZE            32
+
+/** Whether the feature report has pages of statistics, trace or profile. */
+#if defined(LMKBD_STATS) || defined(LMKBD_TRACE) || defined(LMKBD_PROFILE)
+#define FEATURE_PAGES
+#endif
+
+/** Size in bytes of the feature report: keyboard, modes, Mode Lock mode and queue
+ *  statistics, then, with FEATURE_PAGES, the page selected and its contents.
+ */
+#ifdef FEATURE_PAGES
+#define FEATURE_REPORT_SIZE          (7 + 1 + FEATURE_PAGE_SIZE)
+#else
+#define FEATURE_REPORT_SIZE          7
+#endif
 
 /* Function Prototypes: */
 uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
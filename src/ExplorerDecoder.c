@@ -0,0 +1,119 @@
+/*
+  Copyright 2014 Mike McMahon
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ * TI Explorer keyboard serial decoder.
+ *
+ * This only depends on being told the time of each edge on the data
+ * line, so the firmware runs it from a pin change interrupt and the
+ * host can run it over a logic analyzer capture.
+ */
+
+#include "ExplorerDecoder.h"
+
+#define FRAME_BITS 10           // Start, 8 data, stop.
+
+void ExplorerDecoder_Init(ExplorerDecoder *decoder, uint16_t bitTicks)
+{
+  decoder->bitTicks = bitTicks;
+  decoder->lastEdge = 0;
+  decoder->level = true;
+  decoder->busy = false;
+  decoder->nbits = 0;
+  decoder->frame = 0;
+  decoder->bufferStart = decoder->bufferCount = 0;
+  decoder->overruns = 0;
+}
+
+static void ExplorerDecoder_Put(ExplorerDecoder *decoder, uint16_t entry)
+{
+  if (decoder->bufferCount >= EXPLORER_DECODER_BUFFER_SIZE) {
+    decoder->overruns++;
+    return;
+  }
+  decoder->buffer[(decoder->bufferStart + decoder->bufferCount++) % EXPLORER_DECODER_BUFFER_SIZE] = entry;
+}
+
+/** Add count bits at the current level to the frame, finishing it if full. */
+static void ExplorerDecoder_Shift(ExplorerDecoder *decoder, uint16_t count)
+{
+  uint16_t entry;
+
+  while ((count > 0) && (decoder->nbits < FRAME_BITS)) {
+    if (decoder->level)
+      decoder->frame |= (1 << decoder->nbits);
+    decoder->nbits++;
+    count--;
+  }
+  if (decoder->nbits < FRAME_BITS) return;
+
+  entry = (decoder->frame >> 1) & 0xFF;
+  if ((decoder->frame & 1) || !(decoder->frame & (1 << (FRAME_BITS - 1))))
+    entry |= EXPLORER_DECODER_ERROR;
+  ExplorerDecoder_Put(decoder, entry);
+  decoder->busy = false;
+  decoder->nbits = 0;
+  decoder->frame = 0;
+}
+
+/** The line changed to level at time now. Safe to call from an interrupt. */
+void ExplorerDecoder_Edge(ExplorerDecoder *decoder, uint16_t now, bool level)
+{
+  if (decoder->busy) {
+    // Round the time at the old level to whole bits.
+    uint16_t elapsed = now - decoder->lastEdge;
+    uint16_t count = elapsed / decoder->bitTicks;
+    if (elapsed % decoder->bitTicks >= decoder->bitTicks / 2)
+      count++;
+    ExplorerDecoder_Shift(decoder, count);
+  }
+  if (!decoder->busy && !level)
+    decoder->busy = true;       // Start bit.
+  decoder->lastEdge = now;
+  decoder->level = level;
+}
+
+/** Finish a frame whose last bits are all the same level and so have
+ * no edge to end them. Call this often with the current time; between
+ * calls, the clock must not wrap during a frame.
+ */
+void ExplorerDecoder_Idle(ExplorerDecoder *decoder, uint16_t now)
+{
+  uint16_t elapsed, remaining;
+
+  if (!decoder->busy) return;
+  elapsed = now - decoder->lastEdge;
+  remaining = FRAME_BITS - decoder->nbits;
+  if (elapsed >= remaining * decoder->bitTicks - decoder->bitTicks / 2)
+    ExplorerDecoder_Shift(decoder, remaining);
+}
+
+/** Take the next decoded byte, with EXPLORER_DECODER_ERROR if bad. */
+bool ExplorerDecoder_Get(ExplorerDecoder *decoder, uint16_t *entry)
+{
+  if (decoder->bufferCount == 0) return false;
+  *entry = decoder->buffer[decoder->bufferStart];
+  decoder->bufferStart = (decoder->bufferStart + 1) % EXPLORER_DECODER_BUFFER_SIZE;
+  decoder->bufferCount--;
+  return true;
+}
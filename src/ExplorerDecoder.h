@@ -0,0 +1,65 @@
+/*
+  Copyright 2014 Mike McMahon
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ * Header file for ExplorerDecoder.c.
+ */
+
+#ifndef _EXPLORER_DECODER_H_
+#define _EXPLORER_DECODER_H_
+
+/* Includes: */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Macros: */
+/** Number of decoded bytes held until read. */
+#define EXPLORER_DECODER_BUFFER_SIZE 8
+
+/** Bit in a decoded entry set when the frame was bad. */
+#define EXPLORER_DECODER_ERROR 0x100
+
+/* Type Defines: */
+/** Decoder state for an asynchronous serial line: a low start bit,
+ *  eight data bits low bit first, and a high stop bit.
+ *  Times are in whatever unit the caller's clock counts, and may wrap.
+ */
+typedef struct {
+  uint16_t bitTicks;            // Ticks in one bit.
+  uint16_t lastEdge;            // Time of last edge.
+  bool level;                   // Line level since then.
+  bool busy;                    // Within a frame.
+  uint8_t nbits;                // Bits of this frame so far.
+  uint16_t frame;               // Those bits, first in bit 0.
+  uint16_t buffer[EXPLORER_DECODER_BUFFER_SIZE];
+  uint8_t bufferStart, bufferCount;
+  uint8_t overruns;             // Bytes lost to a full buffer.
+} ExplorerDecoder;
+
+/* Function Prototypes: */
+void ExplorerDecoder_Init(ExplorerDecoder *decoder, uint16_t bitTicks);
+void ExplorerDecoder_Edge(ExplorerDecoder *decoder, uint16_t now, bool level);
+void ExplorerDecoder_Idle(ExplorerDecoder *decoder, uint16_t now);
+bool ExplorerDecoder_Get(ExplorerDecoder *decoder, uint16_t *entry);
+
+#endif
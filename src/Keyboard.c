@@ -30,8 +30,14 @@
 
 #include "Keyboard.h"
 
-/** Buffer to hold the previously generated Keyboard HID report, for comparison purposes inside the HID class driver. */
-static USB_KeyboardReport_Data_t PrevKeyboardReport;
+/** Buffer to hold the previously generated Keyboard HID report, for comparison purposes inside the HID class driver.
+ *  LUFA also builds GET_REPORT replies in a buffer of this size, so it must hold the feature report, too.
+ */
+static union {
+  USB_KeyboardReport_Data_t keyboard;
+  uint8_t feature[FEATURE_REPORT_SIZE];
+} PrevReport;
+#define PrevKeyboardReport (PrevReport.keyboard)
 
 /** LUFA HID Class driver interface configuration and state information. This structure is
  *  passed to all HID Class driver functions, so that multiple instances of the same class
@@ -48,8 +54,8 @@ USB_ClassInfo_HID_Device_t Keyboard_HID_Interface =
       .Size                 = KEYBOARD_EPSIZE,
       .Banks                = 1,
     },
-    .PrevReportINBuffer     = &PrevKeyboardReport,
-    .PrevReportINBufferSize = sizeof(PrevKeyboardReport),
+    .PrevReportINBuffer     = &PrevReport,
+    .PrevReportINBufferSize = sizeof(PrevReport),
   },
 };
 
@@ -58,8 +64,9 @@ typedef enum {
 } Keyboard;
 
 typedef enum {
-  HUT1 = 1, EMACS
+  HUT1 = 1, EMACS, UNICODE
 } TranslationMode;
+#define LAST_TRANSLATION_MODE UNICODE
 
 typedef enum {
   NONE = 0,
@@ -101,6 +108,38 @@ typedef struct {
 // non-symbol usage is.
 #define LISP_KEY(idx,hid,keysym) { hid, NONE, keysym }
 
+#ifdef LMKBD_CONSUMER_KEYS
+// Keys sent in the Consumer or System Control report are kept among
+// the keys down as usages from a reserved range of the Keyboard page,
+// each an index into ControlKeys.
+#define CONTROL_KEY_BASE 0xA5
+#define IS_CONTROL_KEY(usage) (((usage) >= CONTROL_KEY_BASE) && ((usage) < CONTROL_KEY_BASE + N_CONTROL_KEYS))
+#define CONTROL_KEY(idx,hid,control,keysym) { CONTROL_KEY_BASE + control, NONE, keysym }
+
+typedef enum {
+  CK_HELP, CK_SELECT, CK_ABORT, CK_SUSPEND, CK_RESUME, CK_STATUS,
+  N_CONTROL_KEYS
+} ControlKeyIndex;
+
+typedef struct {
+  uint8_t reportID;
+  uint16_t usage;
+} ControlKey;
+
+// Linux input key codes as comments.
+static const ControlKey ControlKeys[N_CONTROL_KEYS] PROGMEM = {
+  { REPORT_ID_SYSTEM, 0x87 },      // System Menu Help: KEY_HELP
+  { REPORT_ID_SYSTEM, 0x89 },      // System Menu Select: KEY_SELECT
+  { REPORT_ID_CONSUMER, 0x025F },  // AC Cancel: KEY_CANCEL
+  { REPORT_ID_CONSUMER, 0x00B1 },  // Pause: KEY_PAUSECD
+  { REPORT_ID_CONSUMER, 0x00B0 },  // Play: KEY_PLAYCD
+  { REPORT_ID_CONSUMER, 0x018F },  // AL Task/Project Manager: KEY_TASKMANAGER
+};
+#else
+#define IS_CONTROL_KEY(usage) false
+#define CONTROL_KEY(idx,hid,control,keysym) { hid, NONE, keysym }
+#endif
+
 typedef struct {
   union {
     unsigned all;
@@ -130,35 +169,344 @@ static ModeLockMode CurrentModeLockMode;
 #define MODE_LOCK_MODE MODE_LOCK_MODE_2
 #endif
 
+typedef enum {
+  REPEAT_MODE_NONE, REPEAT_MODE_KEY, REPEAT_MODE_ALWAYS
+} RepeatMode;
+static RepeatMode CurrentRepeatMode;
+
+#ifndef REPEAT_MODE
+#define REPEAT_MODE REPEAT_MODE_KEY
+#endif
+#ifndef REPEAT_DELAY_MS
+#define REPEAT_DELAY_MS 500
+#endif
+#ifndef REPEAT_INTERVAL_MS
+#define REPEAT_INTERVAL_MS 50
+#endif
+
 #define N_MODES 2
+#if FEATURE_REPORT_SIZE < N_MODES + 5
+#error FEATURE_REPORT_SIZE in Descriptors.h is too small for N_MODES
+#endif
+#ifdef LMKBD_FIXED
+#if !defined(LMKBD) || defined(LMKBD_SWITCH) || defined(LMKBD_PROBE)
+#error LMKBD_FIXED needs LMKBD and neither LMKBD_SWITCH nor LMKBD_PROBE in local.mk
+#endif
+// Known at compile time, so every test of it folds away.
+#define CurrentKeyboard ((Keyboard)LMKBD)
+#else
 static Keyboard CurrentKeyboard;
+#endif
+static Keyboard DefaultKeyboard;
 static TranslationMode CurrentModes[N_MODES];
 
-static uint32_t CurrentShifts;
-static HidUsageID KeysDown[16];
-static uint8_t NKeysDown;
+// What is held down on one keyboard.
+typedef struct {
+  uint32_t shifts;
+  HidUsageID keysDown[16];
+  uint8_t nKeysDown;
+} KeyState;
+
+#ifdef LMKBD_DUAL
+// A Symbolics keyboard on its own pins, alongside the selected one.
+#define N_KEY_STATES 2
+static KeyState KeyStates[N_KEY_STATES];
+static KeyState *CurrentKeyState = &KeyStates[0];
+#define SelectKeyState(state) (CurrentKeyState = (state))
+#else
+#define N_KEY_STATES 1
+static KeyState KeyStates[N_KEY_STATES];
+#define CurrentKeyState (&KeyStates[0])
+#define SelectKeyState(state)
+#endif
+
+// Those of the keyboard being processed.
+#define CurrentShifts (CurrentKeyState->shifts)
+#define KeysDown (CurrentKeyState->keysDown)
+#define NKeysDown (CurrentKeyState->nKeysDown)
+
 static bool NeedEmptyReport;
 
-#define N_EMACS_EVENTS 8
-static EmacsEvent EventBuffers[N_EMACS_EVENTS];
-static uint8_t EmacsBufferIn, EmacsBufferOut;
-static uint8_t EmacsBufferedCount;
+// The last report of the keys down, which the host polls for every
+// frame, so that it need only be built again after something it is
+// built from changes: keys or shifts, modes, keyboard or protocol.
+static USB_KeyboardReport_Data_t CachedReport;
+static bool CachedReportValid;
+
+#ifdef LMKBD_CONSUMER_KEYS
+typedef struct {
+  uint16_t consumer[CONSUMER_REPORT_KEYS];
+  uint8_t system;
+} ControlReports;
+static ControlReports SentControlReports;
+// The library's copy of the last report is not the keyboard's.
+static bool ControlReportSent;
+#endif
+
+// A key went down while the host was suspended, so wake it.
+static volatile bool WakeupRequested;
+#ifdef EXTERNAL_LEDS
+static uint8_t SuspendedXLEDs;  // To put back on wakeup.
+#endif
+
+// Counted from USB start of frame, so only while connected to a host.
+static volatile uint16_t MillisecondTicks;
+
+// Timer1 runs free at F_CPU/8, 0.5us at 16MHz, with overflows counted
+// to make 32 bits.
+#define TICKS_PER_SECOND (F_CPU / 8)
+static volatile uint16_t TickOverflows;
 
-static void KeyDown(const KeyInfo *key, bool noKeyUps);
-static void KeyUp(const KeyInfo *key);
+// 5 bytes each.
+#ifndef N_EMACS_EVENTS
+#define N_EMACS_EVENTS 16
+#endif
+typedef struct {
+  EmacsEvent events[N_EMACS_EVENTS];
+  uint8_t in, out, count;
+} EmacsQueue;
+// One for each keyboard, so that a full queue only holds back that
+// keyboard's keys, and each one's events are sent together.
+static EmacsQueue EmacsQueues[N_KEY_STATES];
+#define CurrentEmacsQueue (&EmacsQueues[CurrentKeyState - KeyStates])
+#ifdef LMKBD_DUAL
+static uint8_t EmacsReportQueue; // The one being sent.
+#else
+#define EmacsReportQueue 0
+#endif
+
+typedef struct {
+  uint16_t code;
+  uint8_t stage;                // C-S-u, then each hex digit, then space.
+} UnicodeEvent;
+
+#ifndef N_UNICODE_EVENTS
+#define N_UNICODE_EVENTS 8
+#endif
+static UnicodeEvent UnicodeEvents[N_UNICODE_EVENTS];
+static uint8_t UnicodeBufferIn, UnicodeBufferOut;
+static uint8_t UnicodeBufferedCount;
+
+// Key transitions held back while the Emacs queue is full, so that
+// they are still translated, and in order, once it drains; or that
+// would undo a change not yet reported (see Schedule_Conflicts).
+// Keyboards are not scanned while any are held. Should one scan change
+// more keys than this, the rest are refused, and a scanner leaves them
+// to be seen again next time.
+#ifndef N_KEY_TRANSITIONS
+#define N_KEY_TRANSITIONS 16
+#endif
+typedef struct {
+  /*PROGMEM*/ const KeyInfo *key;
+  bool down;
+  bool noKeyUps;
+#ifdef LMKBD_DUAL
+  KeyState *state;
+#endif
+#ifdef LMKBD_STATS
+  uint32_t detected;
+#endif
+} KeyTransition;
+static KeyTransition KeyTransitions[N_KEY_TRANSITIONS];
+static uint8_t KeyTransitionIn, KeyTransitionOut;
+static uint8_t KeyTransitionCount;
+
+// Usages added to or removed from the keys down since the last report
+// of them was built.
+static uint8_t ScheduleChangedUsages[32];
+static bool ScheduleChanged;
+
+// Most ever queued, and events lost for lack of room in either queue.
+static uint8_t EmacsBufferHighWater, KeyTransitionHighWater;
+static uint8_t QueueDrops;
+
+#ifdef LMKBD_STATS
+// Time from a transition being detected by the scanner to the first
+// report built after it has been translated, in buckets of doubling
+// width: the first is under 2^LATENCY_SHIFT ticks (16us at 16MHz),
+// the last everything from 2^(LATENCY_SHIFT+N_LATENCY_BUCKETS-2).
+#define N_LATENCY_BUCKETS 16
+#define LATENCY_SHIFT 5
+typedef uint16_t LatencyHistogram[N_LATENCY_BUCKETS];
+static LatencyHistogram KeyboardLatency[TI + 1];
+static LatencyHistogram ModeLatency[LAST_TRANSLATION_MODE]; // From HUT1.
+
+// Translated, but not yet in a report.
+#ifndef N_LATENCY_PENDING
+#define N_LATENCY_PENDING 8
+#endif
+typedef struct {
+  uint32_t detected;
+  uint8_t keyboard;
+  uint8_t mode;
+} LatencyPending;
+static LatencyPending LatenciesPending[N_LATENCY_PENDING];
+static uint8_t NLatenciesPending;
+#endif
+
+#ifdef FEATURE_PAGES
+// Which of the pages of statistics, trace or profile the feature report returns.
+static uint8_t FeaturePage;
+#define FEATURE_PAGE_KEYBOARD_LATENCY 0x10 // + Keyboard.
+#define FEATURE_PAGE_MODE_LATENCY 0x20     // + TranslationMode.
+#define FEATURE_PAGE_TRACE 0x30            // Header, then entries from 0x31.
+#define FEATURE_PAGE_PROFILE 0x40          // + ProfileSlot.
+#define FEATURE_PAGE_PROFILE_RESET 0x4F    // Selecting it clears the counters.
+#endif
+
+#ifdef LMKBD_PROFILE
+// Time spent in each of the main loop tasks and scanners, in Ticks.
+typedef enum {
+  PROFILE_SCAN = 0,             // + Keyboard.
+  PROFILE_MIT_READ = TI + 1,
+  PROFILE_LMKBD_TASK,
+  PROFILE_HID_TASK,
+  PROFILE_USB_TASK,
+  N_PROFILE_SLOTS
+} ProfileSlot;
+typedef struct {
+  uint32_t calls;
+  uint32_t ticks;
+  uint16_t maxTicks;
+} ProfileCounter;
+static ProfileCounter ProfileCounters[N_PROFILE_SLOTS];
+#endif
+
+#ifdef LMKBD_TRACE
+// Trace times are 32us at 16MHz, wrapping after about 2s.
+#define TRACE_TIME_SHIFT 6
+#define TRACE_PER_PAGE (FEATURE_PAGE_SIZE / TRACE_ENTRY_SIZE)
+#if (TRACE_ENTRIES + TRACE_PER_PAGE - 1) / TRACE_PER_PAGE > 15
+#error TRACE_ENTRIES does not fit in the trace pages
+#endif
+// Recording starts again this long after the last trace page was
+// read, in case the reader went away without selecting another page.
+#ifndef TRACE_PAUSE_MS
+#define TRACE_PAUSE_MS 500
+#endif
+static Trace FlightTrace;
+static uint16_t TraceReadTime;
+#endif
+
+static /*PROGMEM*/ const KeyInfo *RepeatKey;
+#ifdef LMKBD_DUAL
+static KeyState *RepeatKeyState; // Which keyboard it is on.
+#else
+#define RepeatKeyState CurrentKeyState
+#endif
+static uint16_t RepeatTime;
+static bool RepeatReleased;
+
+static bool KeyDown(const KeyInfo *key, bool noKeyUps);
+static bool KeyUp(const KeyInfo *key);
+static void ProcessKeyDown(const KeyInfo *key, bool noKeyUps);
+static void ProcessKeyUp(const KeyInfo *key);
+static bool DropKeyTransition(void);
+static bool HoldKeyTransition(const KeyInfo *key, bool down, bool noKeyUps);
+static void ProcessKeyTransitions(void);
+static void QueueEmacsEvent(void);
+static bool Schedule_Conflicts(const KeyInfo *key, bool noKeyUps);
+static bool Schedule_Shows(const KeyInfo *key);
+static void Schedule_Changed(HidUsageID usage);
+static void Schedule_Reported(void);
+#ifdef LMKBD_STATS
+static void Stats_Transition(uint32_t detected);
+static void Stats_Report(void);
+static void Stats_Page(uint8_t page, uint8_t *data);
+#else
+#define Stats_Transition(detected)
+#define Stats_Report()
+#endif
+static uint32_t Ticks(void);
+#ifdef FEATURE_PAGES
+static void Feature_Page(uint8_t page, uint8_t *data);
+#endif
+#ifdef LMKBD_PROFILE
+#define PROFILE(slot,call) \
+  do { uint32_t profileStart = Ticks(); call; Profile_Count(slot, profileStart); } while (false)
+static void Profile_Count(uint8_t slot, uint32_t start);
+static void Profile_Page(uint8_t page, uint8_t *data);
+#else
+#define PROFILE(slot,call) call
+#endif
+#ifdef LMKBD_TRACE
+#define TRACE(type,a,b,c) \
+  Trace_Add(&FlightTrace, (uint16_t)(Ticks() >> TRACE_TIME_SHIFT), type, a, b, c)
+static void TraceKey(uint8_t type, const KeyInfo *key, uint8_t flags);
+static void Trace_Page(uint8_t page, uint8_t *data);
+static void Trace_Task(void);
+#else
+#define TRACE(type,a,b,c)
+#define TraceKey(type,key,flags)
+#endif
 static void CreateEmacsEvent(EmacsEvent *event, uint32_t shifts, PGM_P keysym);
+static uint8_t KeysymAlternative(PGM_P keysym, uint32_t shifts, PGM_P *start);
 static void AddEmacsReport(USB_KeyboardReport_Data_t* KeyboardReport);
+static bool AddTranslationReport(USB_KeyboardReport_Data_t* KeyboardReport);
+static bool TranslationPending(void);
+static void HUT1_KeyDown(const KeyInfo *key, bool noKeyUps);
+static void HUT1_KeyUp(const KeyInfo *key);
+static bool HUT1_Never(void);
+static void Emacs_KeyDown(const KeyInfo *key, bool noKeyUps);
+static bool Emacs_Pending(void);
+static bool Emacs_Full(void);
+static void Unicode_KeyDown(const KeyInfo *key, bool noKeyUps);
+static void Unicode_AddReport(USB_KeyboardReport_Data_t* KeyboardReport);
+static bool Unicode_Pending(void);
+static bool Unicode_Full(void);
 static void AddKeyReport(USB_KeyboardReport_Data_t* KeyboardReport);
+static void BuildKeyboardReport(USB_KeyboardReport_Data_t* KeyboardReport);
+#ifdef LMKBD_CONSUMER_KEYS
+static void Control_GetReports(ControlReports *reports);
+static bool Control_CreateReport(uint8_t* const ReportID, void* ReportData, uint16_t* const ReportSize);
+#endif
+static void AddKeyStateReport(KeyState *state, bool noKeyUps,
+                              USB_KeyboardReport_Data_t* KeyboardReport, uint8_t *nkeys);
 static bool IsKeyDown(HidUsageID key);
 
+static void Repeat_Start(const KeyInfo *key);
+static void Repeat_Stop(void);
+static void Repeat_Task(void);
+static void Repeat_Press(void);
+
+static bool Settings_Load(void);
+static void Settings_Save(void);
+static void Settings_Task(void);
+
+static void ResetKeyState(void);
+static void KeyboardInit(void);
+static void KeyboardDone(void);
+static void SelectKeyboard(Keyboard keyboard);
+
 static void MIT_Init(void);
+static void MIT_Done(void);
 static void MIT_Read(bool delay);
+static void TK_Task(void);
+static void TK_Code(void);
+#ifdef TK_SYNTHESIZE_KEYUPS
+static void TK_Press(void);
+#endif
+#ifndef SPACE_CADET_DIRECT
+static void SpaceCadet_Task(void);
+#endif
 static void SMBX_Init(void);
+static void SMBX_Done(void);
 static void SMBX_Scan(void);
+static void SMBX_ScanGroup(uint8_t group);
 #ifdef SPACE_CADET_DIRECT
 static void SpaceCadetDirect_Init(void);
+static void SpaceCadetDirect_Done(void);
 static void SpaceCadetDirect_Scan(void);
 #endif
+static void TI_Init(void);
+static void TI_Done(void);
+static void TI_Task(void);
+static void Suspend_Task(void);
+#ifdef LMKBD_PROBE
+static Keyboard Probe_Keyboard(Keyboard preferred);
+static ExplorerDecoder tiDecoder;
+static void Probe_Task(void);
+#endif
 
 #define LOW 0
 #define HIGH 1
@@ -210,6 +558,34 @@ static void SpaceCadetDirect_Scan(void);
 #define SMBX_KBDIN (1 << 4)
 #define SMBX_KBDNEXT (1 << 5)
 #define SMBX_KBDSCAN (1 << 6)
+// Keys are strobed out in groups of eight.
+#define SMBX_GROUPS 16
+// TI data comes in on the same pin as MIT, which is also INT0.
+#define TI_DDR TK_DDR
+#define TI_PIN TK_PIN
+#define TI_PORT TK_PORT
+#define TI_KBDIN TK_KBDIN
+
+// Edges are timed by Ticks.
+#ifndef TI_BAUD
+#define TI_BAUD 1200
+#endif
+#define TI_BIT_TICKS ((uint16_t)(TICKS_PER_SECOND / TI_BAUD))
+
+#ifdef TK_SYNTHESIZE_KEYUPS
+#ifndef TK_HOLD_MS
+#define TK_HOLD_MS 100
+#endif
+#endif
+
+#ifdef LMKBD_PROBE
+#ifndef PROBE_INTERVAL_MS
+#define PROBE_INTERVAL_MS 250
+#endif
+#ifndef PROBE_SETTLE_US
+#define PROBE_SETTLE_US 20
+#endif
+#endif
 
 #ifdef SPACE_CADET_DIRECT
 #define SC_ADDR_DDR DDRB
@@ -219,11 +595,77 @@ static void SpaceCadetDirect_Scan(void);
 #define SC_STROBE_PORT PORTB
 #define SC_STROBE (1 << 0)
 #define SC_KEYS_PIN PIND
+
+// Longest time allowed for the demux and key lines to settle.
+#ifndef SC_DIRECT_SETTLE_US
+#define SC_DIRECT_SETTLE_US 5
+#endif
+#ifndef SC_DIRECT_CALIBRATE_PASSES
+#define SC_DIRECT_CALIBRATE_PASSES 8
+#endif
+#endif
+
+// What differs between keyboards, indexed by Keyboard.
+typedef struct {
+  void (*init)(void);
+  void (*done)(void);
+  void (*task)(void);           // Called every time around the main loop.
+  bool sendsKeyUps;
+} KeyboardOps;
+
+#ifdef LMKBD_FIXED
+// Looked up with a constant index, so the compiler makes direct calls
+// and the table, along with other keyboards' code, is never emitted.
+#define KEYBOARD_OPS_SECTION
+#define KeyboardOpsFunction(op) (KeyboardOpsTable[LMKBD].op)
+#define KeyboardOpsFlag(op) (KeyboardOpsTable[LMKBD].op)
+#define KeyboardPossible(k) (LMKBD == (k))
+#else
+#define KEYBOARD_OPS_SECTION PROGMEM
+#define KeyboardOpsFunction(op) \
+  ((void (*)(void))pgm_read_ptr(&KeyboardOpsTable[CurrentKeyboard].op))
+#define KeyboardOpsFlag(op) ((bool)pgm_read_byte(&KeyboardOpsTable[CurrentKeyboard].op))
+#define KeyboardPossible(k) true
+#endif
+
+static const KeyboardOps KeyboardOpsTable[] KEYBOARD_OPS_SECTION = {
+#ifdef TK_SYNTHESIZE_KEYUPS
+  [TK] = { MIT_Init, MIT_Done, TK_Task, true },
+#else
+  [TK] = { MIT_Init, MIT_Done, TK_Task, false },
 #endif
+#ifdef SPACE_CADET_DIRECT
+  [SPACE_CADET] = { SpaceCadetDirect_Init, SpaceCadetDirect_Done, SpaceCadetDirect_Scan, true },
+#else
+  [SPACE_CADET] = { MIT_Init, MIT_Done, SpaceCadet_Task, true },
+#endif
+  [SMBX] = { SMBX_Init, SMBX_Done, SMBX_Scan, true },
+  [TI] = { TI_Init, TI_Done, TI_Task, true }
+};
+
+// What differs between translation modes, indexed by TranslationMode.
+// Key transitions go to the current mode; the report goes to whichever
+// mode still has reports of its own to send, else is made from KeysDown.
+typedef struct {
+  void (*keyDown)(const KeyInfo *key, bool noKeyUps); // After common handling.
+  void (*keyUp)(const KeyInfo *key);
+  void (*addReport)(USB_KeyboardReport_Data_t* KeyboardReport);
+  bool (*pending)(void);        // Reports of its own still to send.
+  bool (*full)(void);           // No room for what a key down might add.
+} TranslationOps;
+
+#define TranslationOp(mode,op) \
+  ((__typeof__(TranslationOpsTable[0].op))pgm_read_ptr(&TranslationOpsTable[mode].op))
+
+static const TranslationOps TranslationOpsTable[LAST_TRANSLATION_MODE + 1] PROGMEM = {
+  [HUT1] = { HUT1_KeyDown, HUT1_KeyUp, AddKeyReport, HUT1_Never, HUT1_Never },
+  [EMACS] = { Emacs_KeyDown, HUT1_KeyUp, AddEmacsReport, Emacs_Pending, Emacs_Full },
+  [UNICODE] = { Unicode_KeyDown, HUT1_KeyUp, Unicode_AddReport, Unicode_Pending, Unicode_Full }
+};
 
 static void LMKBD_Init(void)
 {
-  int i;
+  uint8_t i;
 
 #ifdef EXTERNAL_LEDS
   XLEDS_DDR |= XLEDS_ALL;
@@ -231,49 +673,145 @@ static void LMKBD_Init(void)
   XLEDS_PORT |= XLEDS_ALL;
 #endif
 
+#ifdef LMKBD_DUAL
+#if defined(SPACE_CADET_DIRECT) || defined(LMKBD_PROBE)
+#error LMKBD_DUAL needs the Symbolics pins free and cannot be used with SPACE_CADET_DIRECT or LMKBD_PROBE
+#endif
+#endif
+
 #ifdef LMKBD_SWITCH
 #ifdef LMKBD
 #error LMKBD must not be defined if LMKBD_SWITCH is enabled in local.mk
+#endif
+#ifdef LMKBD_PROBE
+#error LMKBD_PROBE must not be defined if LMKBD_SWITCH is enabled in local.mk
 #endif
   // Enable pullups and set keyboard from switch (OPEN = 0, so default it MIT).
   SWITCH_PORT |= SWITCH_MASK;
   CurrentKeyboard = (Keyboard)((SWITCH_PIN & SWITCH_MASK) ^ SWITCH_MASK);
+#elif defined(LMKBD_PROBE)
+#ifdef SPACE_CADET_DIRECT
+#error LMKBD_PROBE cannot be used with SPACE_CADET_DIRECT, which shares the pins
+#endif
+  // LMKBD, if given, is only a preference for when nothing answers.
+#ifdef LMKBD
+  CurrentKeyboard = Probe_Keyboard(LMKBD);
+#else
+  CurrentKeyboard = Probe_Keyboard(SPACE_CADET);
+#endif
 #else
 #ifndef LMKBD
 #error LMKBD must be defined as keyboard type in local.mk
 #endif
+#ifndef LMKBD_FIXED
   CurrentKeyboard = LMKBD;
 #endif
+#endif
+  DefaultKeyboard = CurrentKeyboard;
+
+  // Free-running, for Ticks.
+  TCCR1A = 0;
+  TCCR1B = (1 << CS11);         // F_CPU/8.
+  TIFR1 = (1 << TOV1);
+  TIMSK1 |= (1 << TOIE1);
 
   CurrentModeLockMode = MODE_LOCK_MODE;
+  CurrentRepeatMode = REPEAT_MODE;
   CurrentModes[0] = DEFAULT_MODE;
   CurrentModes[1] = DEFAULT_MODE2;
 
-  CurrentShifts = 0;
-  NKeysDown = 0;
-  for (i = 0; i < sizeof(KeysDown); i++)
-    KeysDown[i] = 0;
-  NeedEmptyReport = false;
+  // Anything saved by the host overrides the compile-time defaults.
+  Settings_Load();
 
-  EmacsBufferIn = EmacsBufferOut = 0;
-  EmacsBufferedCount = 0;
+  ResetKeyState();
 
-  switch (CurrentKeyboard) {
-  case SPACE_CADET:
-#ifdef SPACE_CADET_DIRECT
-    SpaceCadetDirect_Init();
-    break;
-    /* else same as TK */
+  for (i = 0; i < N_KEY_STATES; i++)
+    EmacsQueues[i].in = EmacsQueues[i].out = EmacsQueues[i].count = 0;
+  UnicodeBufferIn = UnicodeBufferOut = 0;
+  UnicodeBufferedCount = 0;
+
+#ifdef LMKBD_TRACE
+  Trace_Init(&FlightTrace);
 #endif
-  case TK:
-    MIT_Init();
-    break;
-  case SMBX:
+
+  KeyboardInit();
+}
+
+static void KeyboardInit(void)
+{
+  KeyboardOpsFunction(init)();
+#ifdef LMKBD_DUAL
+  if (CurrentKeyboard != SMBX)
     SMBX_Init();
-    break;
-  case TI:
-    break;
+#endif
+}
+
+/** Put the current keyboard's pins back the way they were at reset,
+ * except for keeping pull-ups on inputs.
+ */
+static void KeyboardDone(void)
+{
+  KeyboardOpsFunction(done)();
+#ifdef LMKBD_DUAL
+  if (CurrentKeyboard != SMBX)
+    SMBX_Done();
+#endif
+}
+
+/** Switch to another kind of keyboard while staying connected to the host.
+ * Any keys still down are forgotten; the next report is then empty,
+ * which releases them on the host, too.
+ */
+static void SelectKeyboard(Keyboard keyboard)
+{
+#ifndef LMKBD_FIXED
+  if (keyboard == CurrentKeyboard) return;
+  KeyboardDone();
+  ResetKeyState();
+  CurrentKeyboard = keyboard;
+  KeyboardInit();
+#endif
+}
+
+/** Forget all keys, as when the keyboard itself has changed. */
+static void ResetKeyState(void)
+{
+  memset(KeyStates, 0, sizeof(KeyStates));
+  CachedReportValid = false;
+  KeyTransitionIn = KeyTransitionOut = 0;
+  KeyTransitionCount = 0;
+  NeedEmptyReport = false;
+  Schedule_Reported();
+  Repeat_Stop();
+}
+
+static uint16_t Milliseconds(void)
+{
+  uint16_t ticks;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ticks = MillisecondTicks;
+  }
+  return ticks;
+}
+
+ISR(TIMER1_OVF_vect)
+{
+  TickOverflows++;
+}
+
+static uint32_t Ticks(void)
+{
+  uint16_t low, high;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    low = TCNT1;
+    high = TickOverflows;
+    // Wrapped since interrupts were disabled, but not yet counted.
+    if ((TIFR1 & (1 << TOV1)) && (low < 0x8000))
+      high++;
   }
+  return ((uint32_t)high << 16) | low;
 }
 
 static bool NonLockingKeyDown(void)
@@ -295,6 +833,9 @@ static bool NonLockingKeyDown(void)
 static inline TranslationMode CurrentMode(void)
 {
   uint8_t index = 0;
+  // In boot protocol, a BIOS only understands plain keys.
+  if (!Keyboard_HID_Interface.State.UsingReportProtocol)
+    return HUT1;
   if ((CurrentModeLockMode != MODE_LOCK_MODE_NONE) &&
       (CurrentShifts & SHIFT(MODE_LOCK)))
     index = 1;
@@ -303,55 +844,207 @@ static inline TranslationMode CurrentMode(void)
 
 static inline bool sendsKeyUps(void)
 {
-  return (CurrentKeyboard != TK);
+  return KeyboardOpsFlag(sendsKeyUps);
 }
 
 static void LMKBD_Task(void)
 {
-  switch (CurrentKeyboard) {
-  case SPACE_CADET:
-#ifdef SPACE_CADET_DIRECT
-    SpaceCadetDirect_Scan();
-#else
-    if ((TK_PIN & TK_KBDIN) == LOW) // Check for start bit.
-      MIT_Read(true);
+  bool keyDown, mode2;
+#ifdef LMKBD_DUAL
+  uint8_t group;
 #endif
-    break;
-  case TK:
-    if (!NeedEmptyReport && ((TK_PIN & TK_KBDIN) == LOW)) // Skip while empty pending.
-      MIT_Read(false);
-    break;
-  case SMBX:
-    SMBX_Scan();
-    break;
-  case TI:
-    break;
+
+  // Backpressure: while transitions are held, the keyboard keeps the rest.
+  ProcessKeyTransitions();
+  if (KeyTransitionCount == 0)
+    PROFILE(PROFILE_SCAN + CurrentKeyboard, KeyboardOpsFunction(task)());
+
+#ifdef LMKBD_DUAL
+  // The Symbolics keyboard is read eight keys at a time, looking at
+  // the selected one again after each group, so that neither waits on
+  // a whole scan of the other; while idle, that look is just a pin
+  // read. The Symbolics one always sends key ups, so its state need
+  // not wait on the report.
+  if (CurrentKeyboard != SMBX) {
+    for (group = 0; (group < SMBX_GROUPS) && (KeyTransitionCount == 0); group++) {
+      SelectKeyState(&KeyStates[1]);
+      PROFILE(PROFILE_SCAN + SMBX, SMBX_ScanGroup(group));
+      SelectKeyState(&KeyStates[0]);
+      if (KeyTransitionCount == 0)
+        PROFILE(PROFILE_SCAN + CurrentKeyboard, KeyboardOpsFunction(task)());
+    }
+  }
+#endif
+
+  keyDown = NonLockingKeyDown();
+  mode2 = (CurrentMode() != DEFAULT_MODE);
+#ifdef LMKBD_DUAL
+  if (CurrentKeyboard != SMBX) {
+    SelectKeyState(&KeyStates[1]);
+    keyDown |= NonLockingKeyDown();
+    mode2 |= (CurrentMode() != DEFAULT_MODE);
+    SelectKeyState(&KeyStates[0]);
+  }
+#endif
+
+  if (USB_DeviceState == DEVICE_STATE_Suspended) {
+    // All dark until the host wakes.
+    keyDown = mode2 = false;
   }
 
-  if (NonLockingKeyDown()) {
+  if (keyDown) {
     LEDs_TurnOnLEDs(KEYDOWN_LED);
   }
   else {
     LEDs_TurnOffLEDs(KEYDOWN_LED);
   }
-  if (CurrentMode() != DEFAULT_MODE) {
+  if (mode2) {
     LEDs_TurnOnLEDs(MODE2_LED);
   }
   else {
     LEDs_TurnOffLEDs(MODE2_LED);
   }
+
+  Repeat_Task();
+  Settings_Task();
+#ifdef LMKBD_TRACE
+  Trace_Task();
+#endif
+#ifdef LMKBD_PROBE
+  Probe_Task();
+#endif
+}
+
+/** False if there was no room for the transition. */
+static bool KeyDown(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
+{
+  bool held;
+
+  if (DropKeyTransition())
+    return false;
+  held = HoldKeyTransition(key, true, noKeyUps);
+
+  if (USB_DeviceState == DEVICE_STATE_Suspended)
+    WakeupRequested = true;
+
+  TraceKey(TRACE_KEY_DOWN, key,
+           (held ? TRACE_FLAG_HELD : 0) | (noKeyUps ? TRACE_FLAG_NO_KEY_UPS : 0));
+  if (!held) {
+    ProcessKeyDown(key, noKeyUps);
+    Stats_Transition(Ticks());
+  }
+  return true;
+}
+
+/** False if there was no room for the transition. */
+static bool KeyUp(/*PROGMEM*/ const KeyInfo *key)
+{
+  bool held;
+
+  if (DropKeyTransition())
+    return false;
+  held = HoldKeyTransition(key, false, false);
+
+  TraceKey(TRACE_KEY_UP, key, held ? TRACE_FLAG_HELD : 0);
+  if (!held) {
+    ProcessKeyUp(key);
+    Stats_Transition(Ticks());
+  }
+  return true;
+}
+
+/** Is there no room left to hold a transition? */
+static bool DropKeyTransition(void)
+{
+  if (KeyTransitionCount < N_KEY_TRANSITIONS)
+    return false;
+  if (QueueDrops < 0xFF) QueueDrops++;
+  TRACE(TRACE_DROP, CurrentMode(), 0, 0);
+  return true;
+}
+
+/** Keep a transition for later if there might not be room for what it
+ * queues, or if others are already waiting. False if it can be done now.
+ */
+static bool HoldKeyTransition(/*PROGMEM*/ const KeyInfo *key, bool down, bool noKeyUps)
+{
+  KeyTransition *transition;
+
+  if ((KeyTransitionCount == 0) && !TranslationOp(CurrentMode(), full)() &&
+      !Schedule_Conflicts(key, noKeyUps))
+    return false;
+
+  transition = &KeyTransitions[KeyTransitionIn];
+  transition->key = key;
+  transition->down = down;
+  transition->noKeyUps = noKeyUps;
+#ifdef LMKBD_DUAL
+  transition->state = CurrentKeyState;
+#endif
+#ifdef LMKBD_STATS
+  transition->detected = Ticks();
+#endif
+  KeyTransitionIn = (KeyTransitionIn + 1) % N_KEY_TRANSITIONS;
+  KeyTransitionCount++;
+  if (KeyTransitionCount > KeyTransitionHighWater)
+    KeyTransitionHighWater = KeyTransitionCount;
+  return true;
+}
+
+/** Catch up on held transitions, as far as the Emacs queue has room
+ * and the report can take them.
+ */
+static void ProcessKeyTransitions(void)
+{
+  KeyTransition *transition;
+
+  while (KeyTransitionCount > 0) {
+    transition = &KeyTransitions[KeyTransitionOut];
+#ifdef LMKBD_DUAL
+    SelectKeyState(transition->state);
+#endif
+    if (TranslationOp(CurrentMode(), full)() ||
+        Schedule_Conflicts(transition->key, transition->noKeyUps)) {
+      SelectKeyState(&KeyStates[0]);
+      break;
+    }
+    KeyTransitionOut = (KeyTransitionOut + 1) % N_KEY_TRANSITIONS;
+    KeyTransitionCount--;
+    TraceKey(transition->down ? TRACE_KEY_DOWN : TRACE_KEY_UP, transition->key,
+             TRACE_FLAG_CAUGHT_UP | (transition->noKeyUps ? TRACE_FLAG_NO_KEY_UPS : 0));
+    if (transition->down)
+      ProcessKeyDown(transition->key, transition->noKeyUps);
+    else
+      ProcessKeyUp(transition->key);
+    Stats_Transition(transition->detected);
+    SelectKeyState(&KeyStates[0]);
+  }
+}
+
+/** The event at the current keyboard's queue in has been filled in. */
+static void QueueEmacsEvent(void)
+{
+  EmacsQueue *queue = CurrentEmacsQueue;
+
+  queue->in = (queue->in + 1) % N_EMACS_EVENTS;
+  queue->count++;
+  if (queue->count > EmacsBufferHighWater)
+    EmacsBufferHighWater = queue->count;
+  TRACE(TRACE_QUEUE, EMACS, queue->count, 0);
 }
 
-static void KeyDown(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
+static void ProcessKeyDown(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
 {
   HidUsageID usage = pgm_read_byte(&key->hidUsageID);
   KeyShift shift = pgm_read_byte(&key->shift);
-  PGM_P keysym = pgm_read_ptr(&key->keysym);
-  uint32_t specialShifts;
 
+  CachedReportValid = false;
   if (noKeyUps) {
     NKeysDown = 0;
   }
+  else if (shift == NONE) {
+    Repeat_Start(key);
+  }
 
   if ((shift == MODE_LOCK) &&
       (CurrentModeLockMode == MODE_LOCK_MODE_2_SILENT)) {
@@ -360,74 +1053,295 @@ static void KeyDown(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
     return;
   }
 
-  switch (CurrentMode()) {
-  case EMACS:
-    if (shift != NONE) {
-      CurrentShifts |= SHIFT(shift);
-      break;
-    }
-    if (keysym != NULL) {
-      if (EmacsBufferedCount < N_EMACS_EVENTS) {
-        EmacsEvent *event = &EventBuffers[EmacsBufferIn];
-        CreateEmacsEvent(event, CurrentShifts, keysym);
-        if (event->nchars > 0) {
-          // Found actual keysym; queue for sending.
-          EmacsBufferIn = (EmacsBufferIn + 1) % N_EMACS_EVENTS;
-          EmacsBufferedCount++;
-          break;
-        }
-      }
-    }
-    if (NKeysDown < sizeof(KeysDown)) {
-      KeysDown[NKeysDown++] = usage;
-    }
-    specialShifts = CurrentShifts & (SHIFT(L_SUPER) | SHIFT(R_SUPER) |
-                                     SHIFT(L_HYPER) | SHIFT(R_HYPER) |
-                                     SHIFT(L_SYMBOL) | SHIFT(R_SYMBOL)|
-                                     SHIFT(L_GREEK) | SHIFT(R_GREEK));
-    if (specialShifts) {
-      // An ordinary key, but with unusual shifts.  Send prefix.
-      // When we later catch up, the actual key(s) will be sent from KeysDown.
-      EmacsEvent *event = &EventBuffers[EmacsBufferIn];
-      CreateEmacsEvent(event, specialShifts, NULL);
-      EmacsBufferIn = (EmacsBufferIn + 1) % N_EMACS_EVENTS;
-      EmacsBufferedCount++;
-      break;
-    }
-    break;
+  TranslationOp(CurrentMode(), keyDown)(key, noKeyUps);
+  // Not if queued for translation instead.
+  if (Schedule_Shows(key))
+    Schedule_Changed(usage);
+}
 
-  default:
-    if (shift != NONE) {
-      CurrentShifts |= SHIFT(shift);
-      if (shift <= MAX_USB_SHIFT)
-        break;                  // No need for usage entry.
-    }
-    if (noKeyUps) {
-#define MAP_SPECIAL_SHIFT(u,s)          \
-        if (CurrentShifts & SHIFT(s)) { \
-            KeysDown[NKeysDown++] = u;  \
-        }
+static void ProcessKeyUp(/*PROGMEM*/ const KeyInfo *key)
+{
+  HidUsageID usage = pgm_read_byte(&key->hidUsageID);
+  bool wasDown = Schedule_Shows(key);
 
-      MAP_SPECIAL_SHIFT(HID_KEYBOARD_SC_LOCKING_CAPS_LOCK,CAPS_LOCK);
-      MAP_SPECIAL_SHIFT(HID_KEYBOARD_SC_INTERNATIONAL1,L_SYMBOL);
-      MAP_SPECIAL_SHIFT(HID_KEYBOARD_SC_INTERNATIONAL2,R_SYMBOL);
-    }
-    if (NKeysDown < sizeof(KeysDown)) {
-      KeysDown[NKeysDown++] = usage;
-    }
-    break;
-  }
+  CachedReportValid = false;
+  TranslationOp(CurrentMode(), keyUp)(key);
+  if (wasDown && !Schedule_Shows(key))
+    Schedule_Changed(usage);
 }
 
-static void KeyUp(/*PROGMEM*/ const KeyInfo *key)
+/*** Report scheduling ***/
+
+// Transitions are merged into the next report of the keys down, as
+// many as there are, unless one would undo a change that report has
+// not yet shown, as when a key goes down and up between two reports,
+// or while an Emacs sequence is being sent. That one and those after
+// it are then held until the report has been built, so that each
+// transition is seen by the host, in order, in as few reports as
+// possible. USB modifiers are not among the keys down, but count by
+// their own usage IDs just the same.
+
+/** Would this transition undo one not yet reported? */
+static bool Schedule_Conflicts(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
 {
   HidUsageID usage = pgm_read_byte(&key->hidUsageID);
+
+  if (noKeyUps)
+    return ScheduleChanged;     // Replaces all the keys down.
+  return (ScheduleChangedUsages[usage / 8] & (1 << (usage % 8))) != 0;
+}
+
+/** Does the report of the keys down show this key as down? */
+static bool Schedule_Shows(/*PROGMEM*/ const KeyInfo *key)
+{
   KeyShift shift = pgm_read_byte(&key->shift);
-  int i;
 
-  if (shift != NONE) {
-    CurrentShifts &= ~SHIFT(shift);
-  }
+  if ((shift != NONE) && (shift <= MAX_USB_SHIFT))
+    return (CurrentShifts & SHIFT(shift)) != 0; // In the modifier byte.
+  return IsKeyDown(pgm_read_byte(&key->hidUsageID));
+}
+
+static void Schedule_Changed(HidUsageID usage)
+{
+  ScheduleChangedUsages[usage / 8] |= (1 << (usage % 8));
+  ScheduleChanged = true;
+}
+
+/** A report of the keys down has been built. */
+static void Schedule_Reported(void)
+{
+  if (!ScheduleChanged) return;
+  memset(ScheduleChangedUsages, 0, sizeof(ScheduleChangedUsages));
+  ScheduleChanged = false;
+}
+
+/** Does any mode still have reports of its own to send? */
+static bool TranslationPending(void)
+{
+  uint8_t mode;
+
+  for (mode = HUT1; mode <= LAST_TRANSLATION_MODE; mode++) {
+    if (TranslationOp(mode, pending)())
+      return true;
+  }
+  return false;
+}
+
+/** Let the first mode with reports of its own make this one. */
+static bool AddTranslationReport(USB_KeyboardReport_Data_t* KeyboardReport)
+{
+  uint8_t mode;
+
+  for (mode = HUT1; mode <= LAST_TRANSLATION_MODE; mode++) {
+    if (TranslationOp(mode, pending)()) {
+      TranslationOp(mode, addReport)(KeyboardReport);
+      return true;
+    }
+  }
+  return false;
+}
+
+#ifdef LMKBD_STATS
+/*** Latency statistics ***/
+
+/** A transition detected at the given time has just been translated. */
+static void Stats_Transition(uint32_t detected)
+{
+  LatencyPending *pending;
+
+  if (NLatenciesPending >= N_LATENCY_PENDING)
+    return;                     // Scanned faster than reports go out: lose some samples.
+  pending = &LatenciesPending[NLatenciesPending++];
+  pending->detected = detected;
+#ifdef LMKBD_DUAL
+  pending->keyboard = (CurrentKeyState == &KeyStates[0]) ? CurrentKeyboard : SMBX;
+#else
+  pending->keyboard = CurrentKeyboard;
+#endif
+  pending->mode = CurrentMode();
+}
+
+static void Stats_Count(uint16_t *histogram, uint32_t latency)
+{
+  uint8_t bucket = 0;
+
+  latency >>= LATENCY_SHIFT;
+  while ((latency != 0) && (bucket < N_LATENCY_BUCKETS - 1)) {
+    latency >>= 1;
+    bucket++;
+  }
+  if (histogram[bucket] < 0xFFFF)
+    histogram[bucket]++;
+}
+
+/** A report has been built, including anything translated so far. */
+static void Stats_Report(void)
+{
+  uint32_t now;
+  uint8_t i;
+
+  if (NLatenciesPending == 0) return;
+
+  now = Ticks();
+  for (i = 0; i < NLatenciesPending; i++) {
+    LatencyPending *pending = &LatenciesPending[i];
+    Stats_Count(KeyboardLatency[pending->keyboard], now - pending->detected);
+    Stats_Count(ModeLatency[pending->mode - HUT1], now - pending->detected);
+  }
+  NLatenciesPending = 0;
+}
+
+/** Fill in a page of histograms. Counts are little-endian. */
+static void Stats_Page(uint8_t page, uint8_t *data)
+{
+  if ((page >= FEATURE_PAGE_KEYBOARD_LATENCY) &&
+      (page <= FEATURE_PAGE_KEYBOARD_LATENCY + TI)) {
+    memcpy(data, KeyboardLatency[page - FEATURE_PAGE_KEYBOARD_LATENCY], sizeof(LatencyHistogram));
+  }
+  else if ((page >= FEATURE_PAGE_MODE_LATENCY + HUT1) &&
+           (page <= FEATURE_PAGE_MODE_LATENCY + LAST_TRANSLATION_MODE)) {
+    memcpy(data, ModeLatency[page - FEATURE_PAGE_MODE_LATENCY - HUT1], sizeof(LatencyHistogram));
+  }
+}
+#endif
+
+#ifdef LMKBD_TRACE
+/*** Flight recorder ***/
+
+static void TraceKey(uint8_t type, /*PROGMEM*/ const KeyInfo *key, uint8_t flags)
+{
+  TRACE(type, pgm_read_byte(&key->hidUsageID), pgm_read_byte(&key->shift), flags);
+}
+
+/** Fill in the trace header or a page of entries, oldest first.
+ * Recording is paused while a trace page is selected, so that the
+ * pages read are consistent, or until TRACE_PAUSE_MS after the last
+ * one was read.
+ */
+static void Trace_Page(uint8_t page, uint8_t *data)
+{
+  TraceEntry entry;
+  uint8_t i, index;
+
+  if ((page & 0xF0) == FEATURE_PAGE_TRACE)
+    TraceReadTime = Milliseconds();
+  if (page == FEATURE_PAGE_TRACE) {
+    uint32_t ticksPerSecond = TICKS_PER_SECOND;
+    data[0] = TRACE_ENTRIES;
+    data[1] = FlightTrace.count;
+    data[2] = TRACE_ENTRY_SIZE;
+    data[3] = TRACE_TIME_SHIFT;
+    memcpy(&data[4], &ticksPerSecond, sizeof(ticksPerSecond));
+  }
+  else if ((page > FEATURE_PAGE_TRACE) && (page <= FEATURE_PAGE_TRACE + 0x0F)) {
+    index = (page - FEATURE_PAGE_TRACE - 1) * TRACE_PER_PAGE;
+    for (i = 0; i < TRACE_PER_PAGE; i++) {
+      if (!Trace_Get(&FlightTrace, index + i, &entry)) break;
+      Trace_Pack(&entry, &data[i * TRACE_ENTRY_SIZE]);
+    }
+  }
+}
+
+/** Record again once the trace has not been read for a while. */
+static void Trace_Task(void)
+{
+  if (FlightTrace.paused &&
+      ((uint16_t)(Milliseconds() - TraceReadTime) >= TRACE_PAUSE_MS))
+    FlightTrace.paused = false;
+}
+#endif
+
+#ifdef LMKBD_PROFILE
+/*** Main loop profile ***/
+
+static void Profile_Count(uint8_t slot, uint32_t start)
+{
+  ProfileCounter *counter = &ProfileCounters[slot];
+  uint32_t elapsed = Ticks() - start;
+
+  if (counter->ticks + elapsed < counter->ticks)
+    return;                     // Full: leave the average as it was.
+  counter->calls++;
+  counter->ticks += elapsed;
+  if (elapsed > counter->maxTicks)
+    counter->maxTicks = (elapsed > 0xFFFF) ? 0xFFFF : elapsed;
+}
+
+/** Fill in one slot's counters, little-endian, and the clock rate. */
+static void Profile_Page(uint8_t page, uint8_t *data)
+{
+  ProfileCounter *counter;
+  uint32_t ticksPerSecond = TICKS_PER_SECOND;
+
+  if ((page < FEATURE_PAGE_PROFILE) || (page >= FEATURE_PAGE_PROFILE + N_PROFILE_SLOTS))
+    return;
+  counter = &ProfileCounters[page - FEATURE_PAGE_PROFILE];
+  memcpy(&data[0], &counter->calls, sizeof(counter->calls));
+  memcpy(&data[4], &counter->ticks, sizeof(counter->ticks));
+  memcpy(&data[8], &counter->maxTicks, sizeof(counter->maxTicks));
+  memcpy(&data[10], &ticksPerSecond, sizeof(ticksPerSecond));
+}
+#endif
+
+#ifdef FEATURE_PAGES
+/** Fill in the selected page of the feature report; zero if there is no such page. */
+static void Feature_Page(uint8_t page, uint8_t *data)
+{
+  memset(data, 0, FEATURE_PAGE_SIZE);
+#ifdef LMKBD_STATS
+  Stats_Page(page, data);
+#endif
+#ifdef LMKBD_TRACE
+  Trace_Page(page, data);
+#endif
+#ifdef LMKBD_PROFILE
+  Profile_Page(page, data);
+#endif
+}
+#endif
+
+/*** HUT1 mode ***/
+
+// Keys are sent as their usage IDs, as any other keyboard would.
+
+static void HUT1_KeyDown(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
+{
+  HidUsageID usage = pgm_read_byte(&key->hidUsageID);
+  KeyShift shift = pgm_read_byte(&key->shift);
+
+  if (shift != NONE) {
+    CurrentShifts |= SHIFT(shift);
+    if (shift <= MAX_USB_SHIFT)
+      return;                   // No need for usage entry.
+  }
+  if (noKeyUps) {
+#define MAP_SPECIAL_SHIFT(u,s)          \
+    if (CurrentShifts & SHIFT(s)) {     \
+      KeysDown[NKeysDown++] = u;        \
+    }
+
+    MAP_SPECIAL_SHIFT(HID_KEYBOARD_SC_LOCKING_CAPS_LOCK,CAPS_LOCK);
+    MAP_SPECIAL_SHIFT(HID_KEYBOARD_SC_INTERNATIONAL1,L_SYMBOL);
+    MAP_SPECIAL_SHIFT(HID_KEYBOARD_SC_INTERNATIONAL2,R_SYMBOL);
+  }
+  if (NKeysDown < sizeof(KeysDown)) {
+    KeysDown[NKeysDown++] = usage;
+  }
+}
+
+/** Also used by Emacs mode, where key ups are the same. */
+static void HUT1_KeyUp(/*PROGMEM*/ const KeyInfo *key)
+{
+  HidUsageID usage = pgm_read_byte(&key->hidUsageID);
+  KeyShift shift = pgm_read_byte(&key->shift);
+  int i;
+
+  if (shift != NONE) {
+    CurrentShifts &= ~SHIFT(shift);
+  }
+  else if (key == RepeatKey) {
+    Repeat_Stop();
+  }
 
   for (i = 0; i < NKeysDown; i++) {
     if (KeysDown[i] == usage) {
@@ -441,6 +1355,173 @@ static void KeyUp(/*PROGMEM*/ const KeyInfo *key)
   }
 }
 
+static bool HUT1_Never(void)
+{
+  return false;
+}
+
+/*** Emacs mode ***/
+
+// Keys with symbols, and ordinary keys with shifts the host does not
+// know, are queued as events, each sent as a sequence of reports.
+
+static void Emacs_KeyDown(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
+{
+  HidUsageID usage = pgm_read_byte(&key->hidUsageID);
+  KeyShift shift = pgm_read_byte(&key->shift);
+  PGM_P keysym = pgm_read_ptr(&key->keysym);
+  EmacsQueue *queue = CurrentEmacsQueue;
+  uint32_t specialShifts;
+
+  if (shift != NONE) {
+    CurrentShifts |= SHIFT(shift);
+    return;
+  }
+  if (IS_CONTROL_KEY(usage)) {
+    // Already an event of its own, whatever the shifts.
+    if (NKeysDown < sizeof(KeysDown)) {
+      KeysDown[NKeysDown++] = usage;
+    }
+    return;
+  }
+  if (keysym != NULL) {
+    if (queue->count < N_EMACS_EVENTS) {
+      EmacsEvent *event = &queue->events[queue->in];
+      CreateEmacsEvent(event, CurrentShifts, keysym);
+      if (event->nchars > 0) {
+        // Found actual keysym; queue for sending.
+        QueueEmacsEvent();
+        return;
+      }
+    }
+    else {
+      if (QueueDrops < 0xFF)
+        QueueDrops++;           // Sent as plain key instead.
+      TRACE(TRACE_DROP, EMACS, 0, 0);
+    }
+  }
+  if (NKeysDown < sizeof(KeysDown)) {
+    KeysDown[NKeysDown++] = usage;
+  }
+  specialShifts = CurrentShifts & (SHIFT(L_SUPER) | SHIFT(R_SUPER) |
+                                   SHIFT(L_HYPER) | SHIFT(R_HYPER) |
+                                   SHIFT(L_SYMBOL) | SHIFT(R_SYMBOL)|
+                                   SHIFT(L_GREEK) | SHIFT(R_GREEK));
+  if (specialShifts) {
+    // An ordinary key, but with unusual shifts.  Send prefix.
+    // When we later catch up, the actual key(s) will be sent from KeysDown.
+    if (queue->count < N_EMACS_EVENTS) {
+      EmacsEvent *event = &queue->events[queue->in];
+      CreateEmacsEvent(event, specialShifts, NULL);
+      QueueEmacsEvent();
+    }
+    else {
+      if (QueueDrops < 0xFF)
+        QueueDrops++;           // Sent without the prefix.
+      TRACE(TRACE_DROP, EMACS, 0, 0);
+    }
+  }
+}
+
+static bool Emacs_Pending(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < N_KEY_STATES; i++) {
+    if (EmacsQueues[i].count > 0)
+      return true;
+  }
+  return false;
+}
+
+/** Only the current keyboard's. */
+static bool Emacs_Full(void)
+{
+  return (CurrentEmacsQueue->count >= N_EMACS_EVENTS);
+}
+
+/*** Auto-repeat ***/
+
+// The last key to go down is repeated while held: always, or only
+// while Repeat is also held. Each repeat is a release and a press in
+// successive reports, so it goes through the same translation as the
+// original key, including queueing Emacs sequences. Only keyboards
+// that send key ups can say how long a key is held.
+
+static void Repeat_Start(/*PROGMEM*/ const KeyInfo *key)
+{
+  RepeatKey = key;
+#ifdef LMKBD_DUAL
+  RepeatKeyState = CurrentKeyState;
+#endif
+  RepeatTime = Milliseconds() + REPEAT_DELAY_MS;
+  RepeatReleased = false;
+}
+
+static void Repeat_Stop(void)
+{
+  RepeatKey = NULL;
+  RepeatReleased = false;
+}
+
+/** Release the key, if it is time for a repeat. */
+static void Repeat_Task(void)
+{
+  const KeyInfo *key = RepeatKey;
+  bool released;
+
+  if ((key == NULL) || RepeatReleased)
+    return;
+
+  switch (CurrentRepeatMode) {
+  case REPEAT_MODE_NONE:
+    return;
+  case REPEAT_MODE_KEY:
+    if (!(RepeatKeyState->shifts & SHIFT(REPEAT)))
+      return;
+    break;
+  case REPEAT_MODE_ALWAYS:
+    break;
+  }
+
+  // Never ahead of the host: any queued Emacs events go first, and
+  // there is at most one repeat in flight. Nor behind held transitions,
+  // so any up held for this key came from the keyboard.
+  if (NeedEmptyReport || TranslationPending() || (KeyTransitionCount > 0))
+    return;
+  if ((int16_t)(Milliseconds() - RepeatTime) < 0)
+    return;
+
+  SelectKeyState(RepeatKeyState);
+  released = KeyUp(key);
+  SelectKeyState(&KeyStates[0]);
+  if (!released)
+    return;                     // Try again next time.
+  RepeatKey = key;
+  RepeatReleased = true;
+}
+
+/** Press the key again, now that a report without it has been made. */
+static void Repeat_Press(void)
+{
+  uint8_t i, n;
+
+  // Unless really released meanwhile, which waits to be seen after
+  // the repeat's release and must not be followed by this press.
+  for (i = KeyTransitionOut, n = 0; n < KeyTransitionCount;
+       i = (i + 1) % N_KEY_TRANSITIONS, n++) {
+    if ((KeyTransitions[i].key == RepeatKey) && !KeyTransitions[i].down) {
+      Repeat_Stop();
+      return;
+    }
+  }
+
+  SelectKeyState(RepeatKeyState);
+  KeyDown(RepeatKey, false);
+  SelectKeyState(&KeyStates[0]);
+  RepeatTime = Milliseconds() + REPEAT_INTERVAL_MS;
+}
+
 static void CreateEmacsEvent(EmacsEvent *event, uint32_t shifts, PGM_P keysym)
 {
   event->f.all = 0;
@@ -467,39 +1548,46 @@ static void CreateEmacsEvent(EmacsEvent *event, uint32_t shifts, PGM_P keysym)
     }
   }
   else {
-    PGM_P chars;
-    uint8_t nchars;
-    int n;
-    char ch;
-
-    n = 0;
-    if (shifts & (SHIFT(L_SYMBOL) | SHIFT(R_SYMBOL)))
-      n += 1;
-    if (shifts & (SHIFT(L_GREEK) | SHIFT(R_GREEK)))
-      n += 2;
-
-    chars = keysym;
-
-    do {
-      event->chars = chars;
-      nchars = 0;
-      while (true) {
-        ch = pgm_read_byte(chars);
-        if (ch == '\0')
-          break;
-        chars++;
-        if (ch == ',')
-          break;
-        nchars++;
-      }
+    event->nchars = KeysymAlternative(keysym, shifts, &event->chars);
+    event->f.keysym = event->f.recursive = true;
+  }
+}
+
+/** Find which of the comma-separated names in keysym goes with the
+ * Symbol and Greek shifts. Returns its length, and its start in start.
+ */
+static uint8_t KeysymAlternative(PGM_P keysym, uint32_t shifts, PGM_P *start)
+{
+  PGM_P chars;
+  uint8_t nchars;
+  int n;
+  char ch;
+
+  n = 0;
+  if (shifts & (SHIFT(L_SYMBOL) | SHIFT(R_SYMBOL)))
+    n += 1;
+  if (shifts & (SHIFT(L_GREEK) | SHIFT(R_GREEK)))
+    n += 2;
+
+  chars = keysym;
+
+  do {
+    *start = chars;
+    nchars = 0;
+    while (true) {
+      ch = pgm_read_byte(chars);
       if (ch == '\0')
         break;
-    } while (n-- > 0);
-
-    event->nchars = nchars;
+      chars++;
+      if (ch == ',')
+        break;
+      nchars++;
+    }
+    if (ch == '\0')
+      break;
+  } while (n-- > 0);
 
-    event->f.keysym = event->f.recursive = true;
-  }
+  return nchars;
 }
 
 static char ASCII2HUT1(char ch)
@@ -520,22 +1608,31 @@ static char ASCII2HUT1(char ch)
 
 static bool IsKeyDown(HidUsageID key)
 {
-  int i;
+  int i, n;
   if (!key) return false;
-  for (i = 0; i < NKeysDown; i++) {
-    if (KeysDown[i] == key)
-      return true;
+  for (n = 0; n < N_KEY_STATES; n++) {
+    for (i = 0; i < KeyStates[n].nKeysDown; i++) {
+      if (KeyStates[n].keysDown[i] == key)
+        return true;
+    }
   }
   return false;
 }
 
 static void AddEmacsReport(USB_KeyboardReport_Data_t* KeyboardReport)
 {
+  EmacsQueue *queue;
   EmacsEvent *event;
   HidUsageID key, prevKey;
   int i;
 
-  event = &EventBuffers[EmacsBufferOut];
+#ifdef LMKBD_DUAL
+  // Each keyboard's events go out together, then the other's.
+  if (EmacsQueues[EmacsReportQueue].count == 0)
+    EmacsReportQueue = (EmacsReportQueue + 1) % N_KEY_STATES;
+#endif
+  queue = &EmacsQueues[EmacsReportQueue];
+  event = &queue->events[queue->out];
 
   // We try to avoid sending an extra report with no keys down between
   // characters.  However, when one is doubled, there is no alternative.
@@ -643,86 +1740,397 @@ static void AddEmacsReport(USB_KeyboardReport_Data_t* KeyboardReport)
       }
     }
   }
-  else {
-    // Keysym stage.
-    if (event->chars != NULL) {
-      if (event->nchars > 0) {
-        key = ASCII2HUT1(pgm_read_byte(event->chars));
-        if (key == prevKey)
-          KeyboardReport->KeyCode[0] = 0;
-        else {
-          KeyboardReport->KeyCode[0] = key;
-          event->chars++;
-          event->nchars--;
-        }
-      }
-      else {
-        key = HID_KEYBOARD_SC_ENTER;
-        if (key == prevKey)
-          KeyboardReport->KeyCode[0] = 0;
-        else {
-          KeyboardReport->KeyCode[0] = key;
-          event->chars = NULL;
-        }
+  else {
+    // Keysym stage.
+    if (event->chars != NULL) {
+      if (event->nchars > 0) {
+        key = ASCII2HUT1(pgm_read_byte(event->chars));
+        if (key == prevKey)
+          KeyboardReport->KeyCode[0] = 0;
+        else {
+          KeyboardReport->KeyCode[0] = key;
+          event->chars++;
+          event->nchars--;
+        }
+      }
+      else {
+        key = HID_KEYBOARD_SC_ENTER;
+        if (key == prevKey)
+          KeyboardReport->KeyCode[0] = 0;
+        else {
+          KeyboardReport->KeyCode[0] = key;
+          event->chars = NULL;
+        }
+      }
+    }
+    else {
+      // There is nothing left to do for this event.
+      if ((queue->count == 1) && IsKeyDown(prevKey))
+        KeyboardReport->KeyCode[0] = 0;
+      else {
+        queue->out = (queue->out + 1) % N_EMACS_EVENTS;
+        queue->count--;
+        TRACE(TRACE_DEQUEUE, EMACS, queue->count, 0);
+        if (queue->count > 0) {
+          AddEmacsReport(KeyboardReport);
+        }
+        else {
+          // Catch up with actual key settings, before any events
+          // of the other keyboard.
+          AddKeyReport(KeyboardReport);
+        }
+      }
+    }
+  }
+}
+
+static void AddKeyReport(USB_KeyboardReport_Data_t* KeyboardReport)
+{
+  uint8_t nkeys = 0;
+
+  Schedule_Reported();
+  AddKeyStateReport(&KeyStates[0], !sendsKeyUps(), KeyboardReport, &nkeys);
+#ifdef LMKBD_DUAL
+  if (CurrentKeyboard != SMBX)
+    AddKeyStateReport(&KeyStates[1], false, KeyboardReport, &nkeys);
+#endif
+}
+
+/** Merge one keyboard's keys into the report. */
+static void AddKeyStateReport(KeyState *state, bool noKeyUps,
+                              USB_KeyboardReport_Data_t* KeyboardReport, uint8_t *nkeys)
+{
+  uint8_t shifts;
+  int i;
+
+  // Do not even send shifts; they could be out-of-date until the next key down.
+  if (noKeyUps && (state->nKeysDown == 0)) return;
+
+#define ADD_SHIFT(m,s)               \
+  if (state->shifts & SHIFT(s))      \
+    shifts |= m;
+
+  shifts = 0;
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTCTRL,L_CONTROL);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTSHIFT,L_SHIFT);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTALT,L_ALT);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTGUI,L_GUI);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTCTRL,R_CONTROL);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTSHIFT,R_SHIFT);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTALT,R_ALT);
+  ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTGUI,R_GUI);
+  KeyboardReport->Modifier |= shifts;
+
+  for (i = 0; i < state->nKeysDown; i++) {
+    if (IS_CONTROL_KEY(state->keysDown[i]))
+      continue;               // In its own report.
+    if (*nkeys < sizeof(KeyboardReport->KeyCode)) {
+      KeyboardReport->KeyCode[(*nkeys)++] = state->keysDown[i];
+    }
+    else {
+      memset(KeyboardReport->KeyCode, HID_KEYBOARD_SC_ERROR_ROLLOVER,
+             sizeof(KeyboardReport->KeyCode));
+      break;
+    }
+  }
+
+  if (noKeyUps) {
+    state->nKeysDown = 0;       // Only sent once.
+    CachedReportValid = false;
+    NeedEmptyReport = true;
+  }
+}
+
+/*** Unicode mode ***/
+
+// Graphic legends are typed with the Ctrl+Shift+U hex entry that GTK
+// and IBus understand: C-S-u, the hex digits, then space, each key
+// replacing the last in the next report, so only a repeated digit
+// takes an extra one. Keys without a codepoint, or with Control, Meta,
+// Super or Hyper, are sent as in HUT1 mode.
+
+// UnicodeKeysymNames and UnicodeKeysymCodes, generated by the makefile
+// from lmkbd-graphic-keysyms in emacs/lmkbd.el.
+#include "UnicodeKeysyms.h"
+
+/** Codepoint for the keysym name in chars, or 0 if none. */
+static uint16_t UnicodeKeysymCode(PGM_P chars, uint8_t nchars, bool shifted)
+{
+  PGM_P name = UnicodeKeysymNames;
+  uint8_t index, i;
+  uint16_t code;
+  char ch;
+
+  for (index = 0; index < sizeof(UnicodeKeysymCodes) / sizeof(UnicodeKeysymCodes[0]); index++) {
+    for (i = 0; ; i++) {
+      ch = pgm_read_byte(name + i);
+      if ((i == nchars) || (ch != pgm_read_byte(chars + i)))
+        break;
+    }
+    if ((i == nchars) && (ch == '\0')) {
+      code = 0;
+      if (shifted)
+        code = pgm_read_word(&UnicodeKeysymCodes[index][1]);
+      if (code == 0)
+        code = pgm_read_word(&UnicodeKeysymCodes[index][0]);
+      return code;
+    }
+    while (pgm_read_byte(name++) != '\0');
+  }
+  return 0;
+}
+
+static void Unicode_KeyDown(/*PROGMEM*/ const KeyInfo *key, bool noKeyUps)
+{
+  PGM_P keysym = pgm_read_ptr(&key->keysym);
+  PGM_P chars;
+  uint8_t nchars;
+  uint16_t code;
+
+  if ((keysym != NULL) &&
+      !(CurrentShifts & (SHIFT(L_CONTROL) | SHIFT(R_CONTROL) |
+                         SHIFT(L_META) | SHIFT(R_META) |
+                         SHIFT(L_SUPER) | SHIFT(R_SUPER) |
+                         SHIFT(L_HYPER) | SHIFT(R_HYPER)))) {
+    nchars = KeysymAlternative(keysym, CurrentShifts, &chars);
+    code = UnicodeKeysymCode(chars, nchars,
+                             (CurrentShifts & (SHIFT(L_SHIFT) | SHIFT(R_SHIFT))) != 0);
+    if (code != 0) {
+      if (UnicodeBufferedCount < N_UNICODE_EVENTS) {
+        UnicodeEvent *event = &UnicodeEvents[UnicodeBufferIn];
+        event->code = code;
+        event->stage = 0;
+        UnicodeBufferIn = (UnicodeBufferIn + 1) % N_UNICODE_EVENTS;
+        UnicodeBufferedCount++;
+        TRACE(TRACE_QUEUE, UNICODE, UnicodeBufferedCount, 0);
+        return;
+      }
+      if (QueueDrops < 0xFF)
+        QueueDrops++;           // Sent as plain key instead.
+      TRACE(TRACE_DROP, UNICODE, 0, 0);
+    }
+  }
+  HUT1_KeyDown(key, noKeyUps);
+}
+
+static void Unicode_AddReport(USB_KeyboardReport_Data_t* KeyboardReport)
+{
+  UnicodeEvent *event;
+  HidUsageID prevKey;
+
+  event = &UnicodeEvents[UnicodeBufferOut];
+  prevKey = PrevKeyboardReport.KeyCode[0];
+
+  KeyboardReport->Modifier = 0;
+  memset(KeyboardReport->KeyCode, 0, sizeof(KeyboardReport->KeyCode));
+  if (UnicodeEntry_Next(event->code, &event->stage, prevKey,
+                        &KeyboardReport->Modifier, &KeyboardReport->KeyCode[0]))
+    return;
+
+  // There is nothing left to do for this event.
+  if ((UnicodeBufferedCount == 1) && IsKeyDown(prevKey))
+    return;
+  UnicodeBufferOut = (UnicodeBufferOut + 1) % N_UNICODE_EVENTS;
+  UnicodeBufferedCount--;
+  TRACE(TRACE_DEQUEUE, UNICODE, UnicodeBufferedCount, 0);
+  if (UnicodeBufferedCount > 0) {
+    Unicode_AddReport(KeyboardReport);
+  }
+  else {
+    // Catch up with actual key settings.
+    AddKeyReport(KeyboardReport);
+  }
+}
+
+static bool Unicode_Pending(void)
+{
+  return (UnicodeBufferedCount > 0);
+}
+
+static bool Unicode_Full(void)
+{
+  return (UnicodeBufferedCount >= N_UNICODE_EVENTS);
+}
+
+/*** Persistent settings ***/
+
+// Settings are kept in EEPROM as a log of fixed-size records. Each
+// save goes to the slot after the newest one, so that wear is spread
+// over all the slots. At power-up, the newest record that passes its
+// check wins; if there is none, the compile-time defaults stay.
+
+#ifndef SETTINGS_EEPROM_START
+#define SETTINGS_EEPROM_START 0
+#endif
+#ifndef SETTINGS_EEPROM_SLOTS
+#define SETTINGS_EEPROM_SLOTS 32
+#endif
+#if SETTINGS_EEPROM_SLOTS > 32
+#error SETTINGS_EEPROM_SLOTS must fit in the rejected slots mask
+#endif
+
+// Not 0xFF, so that erased EEPROM is never taken for a record.
+#define SETTINGS_VERSION 1
+
+typedef struct {
+  uint8_t version;
+  uint8_t sequence;
+  uint8_t keyboard;
+  uint8_t defaultKeyboard;      // Switch or LMKBD when saved.
+  uint8_t modes[N_MODES];
+  uint8_t modeLockMode;
+  uint8_t check;
+} SettingsRecord;
+
+// Most recent record, either loaded or being written.
+static SettingsRecord SettingsCurrent;
+static uint8_t SettingsSlot, SettingsWriteIndex;
+
+static inline SettingsRecord *SettingsAddress(uint8_t slot)
+{
+  return (SettingsRecord *)(SETTINGS_EEPROM_START + (slot * sizeof(SettingsRecord)));
+}
+
+static uint8_t SettingsCheck(const SettingsRecord *record)
+{
+  const uint8_t *bytes = (const uint8_t *)record;
+  uint8_t check = 0;
+  int i;
+
+  for (i = 0; i < offsetof(SettingsRecord, check); i++) {
+    check = _crc8_ccitt_update(check, bytes[i]);
+  }
+  return check;
+}
+
+static bool SettingsValid(const SettingsRecord *record)
+{
+  int i;
+
+  if (record->check != SettingsCheck(record))
+    return false;
+  if ((record->keyboard > TI) ||
+      (record->modeLockMode > MODE_LOCK_MODE_2_SILENT))
+    return false;
+  for (i = 0; i < N_MODES; i++) {
+    if ((record->modes[i] < HUT1) || (record->modes[i] > LAST_TRANSLATION_MODE))
+      return false;
+  }
+  return true;
+}
+
+/** Restore settings from the newest valid record.
+ * Only the version and sequence bytes of each slot are read while
+ * looking, so this takes well under a millisecond.
+ */
+static bool Settings_Load(void)
+{
+  SettingsRecord record;
+  uint32_t rejected = 0;
+  uint8_t slot, best = 0, bestSequence = 0;
+  bool found;
+  int i;
+
+  SettingsWriteIndex = sizeof(SettingsRecord); // Nothing to write.
+
+  while (true) {
+    found = false;
+    for (slot = 0; slot < SETTINGS_EEPROM_SLOTS; slot++) {
+      SettingsRecord *address = SettingsAddress(slot);
+      uint8_t sequence;
+
+      if (rejected & ((uint32_t)1 << slot)) continue;
+      if (eeprom_read_byte(&address->version) != SETTINGS_VERSION) continue;
+      sequence = eeprom_read_byte(&address->sequence);
+      if (!found || ((int8_t)(sequence - bestSequence) > 0)) {
+        best = slot;
+        bestSequence = sequence;
+        found = true;
       }
     }
-    else {
-      // There is nothing left to do for this event.
-      if ((EmacsBufferedCount == 1) && IsKeyDown(prevKey))
-        KeyboardReport->KeyCode[0] = 0;
-      else {
-        EmacsBufferOut = (EmacsBufferOut + 1) % N_EMACS_EVENTS;
-        EmacsBufferedCount--;
-        if (EmacsBufferedCount > 0) {
-          AddEmacsReport(KeyboardReport);
-        }
-        else {
-          // Catch up with actual key settings.
-          AddKeyReport(KeyboardReport);
-        }
+    if (!found) {
+      // Next save goes to the first slot.
+      SettingsSlot = SETTINGS_EEPROM_SLOTS - 1;
+      SettingsCurrent.sequence = 0xFF;
+      SettingsCurrent.keyboard = CurrentKeyboard;
+      SettingsCurrent.defaultKeyboard = DefaultKeyboard;
+      for (i = 0; i < N_MODES; i++) {
+        SettingsCurrent.modes[i] = CurrentModes[i];
       }
+      SettingsCurrent.modeLockMode = CurrentModeLockMode;
+      return false;
     }
+    eeprom_read_block(&record, SettingsAddress(best), sizeof(record));
+    if (SettingsValid(&record))
+      break;
+    // Torn or corrupted write; fall back to an older one.
+    rejected |= (uint32_t)1 << best;
+  }
+
+  SettingsSlot = best;
+  SettingsCurrent = record;
+
+#ifndef LMKBD_FIXED
+  // A saved keyboard type only applies while the default it was saved
+  // under is unchanged, so that moving the switch or flashing a
+  // different LMKBD still takes effect.
+  if (record.defaultKeyboard == DefaultKeyboard)
+    CurrentKeyboard = (Keyboard)record.keyboard;
+#endif
+  for (i = 0; i < N_MODES; i++) {
+    CurrentModes[i] = (TranslationMode)record.modes[i];
   }
+  CurrentModeLockMode = (ModeLockMode)record.modeLockMode;
+  return true;
 }
 
-static void AddKeyReport(USB_KeyboardReport_Data_t* KeyboardReport)
+/** Start saving current settings, if they differ from the last ones. */
+static void Settings_Save(void)
 {
-  bool noKeyUps = !sendsKeyUps();
-  uint8_t shifts;
+  bool changed = false;
   int i;
 
-  // Do not even send shifts; they could be out-of-date until the next key down.
-  if (noKeyUps && (NKeysDown == 0)) return;
-
-#define ADD_SHIFT(m,s)          \
-  if (CurrentShifts & SHIFT(s)) \
-    shifts |= m;
-
-  shifts = 0;
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTCTRL,L_CONTROL);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTSHIFT,L_SHIFT);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTALT,L_ALT);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_LEFTGUI,L_GUI);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTCTRL,R_CONTROL);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTSHIFT,R_SHIFT);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTALT,R_ALT);
-  ADD_SHIFT(HID_KEYBOARD_MODIFIER_RIGHTGUI,R_GUI);
-  KeyboardReport->Modifier = shifts;
-
-  if (NKeysDown > sizeof(KeyboardReport->KeyCode)) {
-    for (i = 0; i < sizeof(KeyboardReport->KeyCode); i++) {
-      KeyboardReport->KeyCode[i] = HID_KEYBOARD_SC_ERROR_ROLLOVER;
-    }
+  if (SettingsCurrent.keyboard != CurrentKeyboard) {
+    SettingsCurrent.keyboard = CurrentKeyboard;
+    changed = true;
   }
-  else {
-    for (i = 0; i < NKeysDown; i++) {
-      KeyboardReport->KeyCode[i] = KeysDown[i];
+  if (SettingsCurrent.defaultKeyboard != DefaultKeyboard) {
+    SettingsCurrent.defaultKeyboard = DefaultKeyboard;
+    changed = true;
+  }
+  for (i = 0; i < N_MODES; i++) {
+    if (SettingsCurrent.modes[i] != CurrentModes[i]) {
+      SettingsCurrent.modes[i] = CurrentModes[i];
+      changed = true;
     }
   }
+  if (SettingsCurrent.modeLockMode != CurrentModeLockMode) {
+    SettingsCurrent.modeLockMode = CurrentModeLockMode;
+    changed = true;
+  }
+  if (!changed) return;
 
-  if (noKeyUps) {
-    NKeysDown = 0;              // Only sent once.
-    NeedEmptyReport = true;
+  if (SettingsWriteIndex >= sizeof(SettingsRecord)) {
+    // Not already writing, so advance to the next slot. Otherwise,
+    // just start over in the same one.
+    SettingsSlot = (SettingsSlot + 1) % SETTINGS_EEPROM_SLOTS;
+    SettingsCurrent.sequence++;
+  }
+  SettingsCurrent.version = SETTINGS_VERSION;
+  SettingsCurrent.check = SettingsCheck(&SettingsCurrent);
+  SettingsWriteIndex = 0;
+}
+
+/** Write at most one byte of a pending record.
+ * An EEPROM write takes about 3.4 msec, so never wait for one to
+ * finish; just pick up on a later pass through the main loop.
+ */
+static void Settings_Task(void)
+{
+  if ((SettingsWriteIndex < sizeof(SettingsRecord)) && eeprom_is_ready()) {
+    eeprom_update_byte((uint8_t *)SettingsAddress(SettingsSlot) + SettingsWriteIndex,
+                       ((const uint8_t *)&SettingsCurrent)[SettingsWriteIndex]);
+    SettingsWriteIndex++;
   }
 }
 
@@ -841,6 +2249,8 @@ static const KeyInfo TKKeys[64] PROGMEM = {
 
 static void TKShiftKeys(uint16_t mask)
 {
+  CachedReportValid = false;    // Even if the key that follows is held.
+
 #define UPDATE_SHIFTS(n,s)              \
   if (mask & ((uint16_t)1 << n))  \
     CurrentShifts |= SHIFT(s);          \
@@ -975,8 +2385,8 @@ static const KeyInfo SpaceCadetKeys[128] PROGMEM = {
   NO_KEY(043),
   SHIFT_KEY(044, HID_KEYBOARD_SC_INTERNATIONAL3, L_GREEK), /* left greek */
   SHIFT_KEY(045, HID_KEYBOARD_SC_LEFT_ALT, L_META), /* left meta */
-  LISP_KEY(046, HID_KEYBOARD_SC_F20, KS_SC_046), /* status */
-  LISP_KEY(047, HID_KEYBOARD_SC_F10, KS_SC_047), /* resume */
+  CONTROL_KEY(046, HID_KEYBOARD_SC_F20, CK_STATUS, KS_SC_046), /* status */
+  CONTROL_KEY(047, HID_KEYBOARD_SC_F10, CK_RESUME, KS_SC_047), /* resume */
   LISP_KEY(050, HID_KEYBOARD_SC_F5, KS_SC_050), /* clear screen */
   PC_KEY(051, HID_KEYBOARD_SC_6_AND_CARET, KS_SC_051), /* 6 */
   PC_KEY(052, HID_KEYBOARD_SC_Y, KS_SC_052), /* y */
@@ -992,7 +2402,7 @@ static const KeyInfo SpaceCadetKeys[128] PROGMEM = {
   PC_KEY(064, HID_KEYBOARD_SC_X, KS_SC_064), /* x */
   SHIFT_KEY(065, HID_KEYBOARD_SC_RIGHT_GUI, R_SUPER), /* right super */
   NO_KEY(066),
-  LISP_KEY(067, HID_KEYBOARD_SC_F18, KS_SC_067), /* abort */
+  CONTROL_KEY(067, HID_KEYBOARD_SC_F18, CK_ABORT, KS_SC_067), /* abort */
   NO_KEY(070),
   PC_KEY(071, HID_KEYBOARD_SC_9_AND_OPENING_PARENTHESIS, KS_SC_071), /* 9 */
   PC_KEY(072, HID_KEYBOARD_SC_O, KS_SC_072), /* o */
@@ -1017,7 +2427,7 @@ static const KeyInfo SpaceCadetKeys[128] PROGMEM = {
   PC_KEY(113, HID_KEYBOARD_SC_G, KS_SC_113), /* g */
   PC_KEY(114, HID_KEYBOARD_SC_B, KS_SC_114), /* b */
   SHIFT_KEY(115, HID_KEYBOARD_SC_AGAIN, REPEAT), /* repeat */
-  LISP_KEY(116, HID_KEYBOARD_SC_HELP, KS_SC_116), /* help */
+  CONTROL_KEY(116, HID_KEYBOARD_SC_HELP, CK_HELP, KS_SC_116), /* help */
   LISP_KEY(117, HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW, KS_SC_117), /* hand left */
   LISP_KEY(120, HID_KEYBOARD_SC_ESCAPE, KS_SC_120), /* quote */
   PC_KEY(121, HID_KEYBOARD_SC_1_AND_EXCLAMATION, KS_SC_121), /* 1 */
@@ -1036,7 +2446,7 @@ static const KeyInfo SpaceCadetKeys[128] PROGMEM = {
   PC_KEY(136, HID_KEYBOARD_SC_ENTER, NULL), /* return */
   LISP_KEY(137, HID_KEYBOARD_SC_KEYPAD_CLOSING_PARENTHESIS, KS_SC_137), /* ) */
   NO_KEY(140),
-  LISP_KEY(141, HID_KEYBOARD_SC_F12, KS_SC_141), /* system */
+  CONTROL_KEY(141, HID_KEYBOARD_SC_F12, CK_SELECT, KS_SC_141), /* system */
   NO_KEY(142),
   LISP_KEY(143, HID_KEYBOARD_SC_F14, KS_SC_143), /* alt mode */
   NO_KEY(144),
@@ -1077,6 +2487,9 @@ static void SpaceCadetAllKeysUp(uint16_t mask)
   uint32_t shift;
   int i, j;
 
+  Repeat_Stop();
+  CachedReportValid = false;
+
   if (0 == mask) {
     CurrentShifts = 0;
     NKeysDown = 0;
@@ -1140,10 +2553,24 @@ static void SpaceCadetAllKeysUp(uint16_t mask)
 
 static uint8_t tkBits[3];
 
+#ifdef TK_SYNTHESIZE_KEYUPS
+static bool tkHeld, tkPendingPress;
+static uint16_t tkReleaseTime;
+#endif
+
 void MIT_Init(void)
 {
   TK_DDR |= TK_KBDCLK;
   TK_PORT |= (TK_KBDCLK | TK_KBDIN); // Clock idle until data goes low.
+
+#ifdef TK_SYNTHESIZE_KEYUPS
+  tkHeld = tkPendingPress = false;
+#endif
+}
+
+static void MIT_Done(void)
+{
+  TK_DDR &= ~TK_KBDCLK;         // Still pulled up, so reads as idle.
 }
 
 /** Read and process 24 bits of code.
@@ -1166,8 +2593,13 @@ static void MIT_Read(bool delay)
     }
     tkBits[i] = code;
   }
+  TRACE(TRACE_SCAN_MIT, tkBits[0], tkBits[1], tkBits[2]);
   switch (tkBits[2]) {
   case 0xF9:
+    if (!KeyboardPossible(SPACE_CADET)) break;
+#ifdef LMKBD_PROBE
+    CurrentKeyboard = SPACE_CADET; // Only Space Cadet sends these.
+#endif
     switch (tkBits[1] & 0xC0) {
     case 0:
       if (tkBits[1] & 0x01)
@@ -1181,76 +2613,243 @@ static void MIT_Read(bool delay)
     }
     break;
   case 0xFF:
-    TKShiftKeys((tkBits[0] >> 7) | ((uint16_t)tkBits[1] << 1));
-    KeyDown(&TKKeys[(tkBits[0] & 0x7F) >> 1], true); // There are no up transitions.
+    if (!KeyboardPossible(TK)) break;
+#ifdef LMKBD_PROBE
+    CurrentKeyboard = TK;
+#endif
+    TK_Code();
     break;
   }
 }
 
-#ifdef SPACE_CADET_DIRECT
+#ifdef TK_SYNTHESIZE_KEYUPS
 
-static uint8_t scDirectKeyStates[16], scDirectNKeyStates[16];
+// Each Knight key is taken to be held, along with the shifts sent
+// with it, until TK_HOLD_MS has passed or another key comes. Shifts
+// therefore stay down across keys typed together, and a different key
+// can replace the previous one in a single report, rather than always
+// going through an empty one.
 
-/** Read directly from SN74154 decoder.
- * See LMIO; UKBD > for 8748 version.
- */
-static uint8_t SpaceCadetDirect_Read(uint8_t column)
+static void TK_Release(void)
 {
-  uint8_t p2;
+  NKeysDown = 0;
+  TKShiftKeys(0);
+  tkHeld = false;
+}
 
-  SC_ADDR_PORT = (SC_ADDR_PORT & ~(0x0F << SC_ADDR_SHIFT)) | (column << SC_ADDR_SHIFT);
-  SC_STROBE_PORT &= ~SC_STROBE;
+/** Process the code left in tkBits, now that the host has seen a release. */
+static void TK_Press(void)
+{
+  tkPendingPress = false;
+  TK_Code();
+}
+
+static void TK_Task(void)
+{
+  if (tkPendingPress) return;   // Code still in tkBits.
+  if (tkHeld && ((int16_t)(Milliseconds() - tkReleaseTime) >= 0))
+    TK_Release();
+  if ((TK_PIN & TK_KBDIN) == LOW)
+    PROFILE(PROFILE_MIT_READ, MIT_Read(false));
+}
 
-#if 0
-  __asm__ __volatile__ ("nop");
 #else
-  _delay_us(5);
+
+static void TK_Task(void)
+{
+  if (!NeedEmptyReport && ((TK_PIN & TK_KBDIN) == LOW)) // Skip while empty pending.
+    PROFILE(PROFILE_MIT_READ, MIT_Read(false));
+}
+
 #endif
 
-  p2 = SC_KEYS_PIN;
+static void TK_Code(void)
+{
+  /*PROGMEM*/ const KeyInfo *key = &TKKeys[(tkBits[0] & 0x7F) >> 1];
+
+#ifdef TK_SYNTHESIZE_KEYUPS
+  if (tkHeld && IsKeyDown(pgm_read_byte(&key->hidUsageID))) {
+    // The host would just see it still down, so let it go first.
+    TK_Release();
+    tkPendingPress = true;
+    return;
+  }
+  tkHeld = true;
+  tkReleaseTime = Milliseconds() + TK_HOLD_MS;
+#endif
 
-  SC_STROBE_PORT |= SC_STROBE;
-  return p2;
+  TKShiftKeys((tkBits[0] >> 7) | ((uint16_t)tkBits[1] << 1));
+  KeyDown(key, true);           // There are no up transitions.
 }
 
-static void SpaceCadetDirect_Init(void)
+#ifndef SPACE_CADET_DIRECT
+static void SpaceCadet_Task(void)
 {
-  int i;
+  if ((TK_PIN & TK_KBDIN) == LOW) // Check for start bit.
+    PROFILE(PROFILE_MIT_READ, MIT_Read(true));
+}
+#endif
+
+#ifdef SPACE_CADET_DIRECT
 
-  SC_ADDR_DDR |= (0x0F << SC_ADDR_SHIFT);
-  SC_STROBE_DDR |= SC_STROBE;
-  SC_STROBE_PORT |= SC_STROBE;  // Idle high.
+/** Read directly from SN74154 decoder.
+ * See LMIO; UKBD > for 8748 version.
+ */
+#define MATRIX_NAME SpaceCadetDirect
+#define MATRIX_VAR(name) scDirect##name
+#define MATRIX_COLUMNS 16
+#define MATRIX_KEYS SpaceCadetKeys
+#define MATRIX_SETTLE_US SC_DIRECT_SETTLE_US
+#define MATRIX_CALIBRATE_PASSES SC_DIRECT_CALIBRATE_PASSES
+#ifdef SC_DIRECT_GHOST_MASK
+#define MATRIX_GHOST_MASK
+#endif
+#define MATRIX_INIT() do {                                      \
+    SC_ADDR_DDR |= (0x0F << SC_ADDR_SHIFT);                     \
+    SC_STROBE_DDR |= SC_STROBE;                                 \
+    SC_STROBE_PORT |= SC_STROBE; /* Idle high. */               \
+  } while (0)
+#define MATRIX_DONE() do {                                      \
+    SC_ADDR_DDR &= ~(0x0F << SC_ADDR_SHIFT);                    \
+    SC_STROBE_DDR &= ~SC_STROBE;                                \
+  } while (0)
+#define MATRIX_SELECT(column) do {                              \
+    SC_ADDR_PORT = (SC_ADDR_PORT & ~(0x0F << SC_ADDR_SHIFT)) |  \
+                   ((column) << SC_ADDR_SHIFT);                 \
+    SC_STROBE_PORT &= ~SC_STROBE;                               \
+  } while (0)
+#define MATRIX_DESELECT() (SC_STROBE_PORT |= SC_STROBE)
+#define MATRIX_ROWS() (SC_KEYS_PIN)
+#include "MatrixScan.h"
+
+#endif
+
+#ifdef LMKBD_PROBE
+
+/*** Keyboard detection ***/
 
-  for (i = 0; i < 16; i++)
-    scDirectKeyStates[i] = 0;
+/** Is a keyboard connected to this data line?
+ * With the pull-up on, a keyboard holding the line low (e.g., a start
+ * bit) is certainly there. Otherwise, discharge the line and let go
+ * without the pull-up: a floating line stays low, but one attached to
+ * a keyboard output or 8748 port is pulled back up. The low pulse is
+ * too short for a keyboard to take it as a clock.
+ */
+static bool Probe_Present(volatile uint8_t *ddr, volatile uint8_t *port,
+                          volatile uint8_t *pin, uint8_t mask)
+{
+  bool present;
+
+  *ddr &= ~mask;
+  *port |= mask;                // Input with pull-up.
+  _delay_us(PROBE_SETTLE_US);
+  if ((*pin & mask) == LOW)
+    return true;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *port &= ~mask;
+    *ddr |= mask;               // Drive low.
+    _delay_us(1);
+    *ddr &= ~mask;              // Let go, no pull-up.
+    _delay_us(PROBE_SETTLE_US);
+    present = ((*pin & mask) != LOW);
+    *port |= mask;              // Pull-up again.
+  }
+  return present;
 }
 
-static void SpaceCadetDirect_Scan(void)
+static bool Probe_SMBX(void)
 {
-  int i,j;
+  return Probe_Present(&SMBX_DDR, &SMBX_PORT, &SMBX_PIN, SMBX_KBDIN);
+}
 
-  for (i = 0; i < 16; i++) {
-    scDirectNKeyStates[i] = SpaceCadetDirect_Read(i);
+/** The MIT line is also TI's, where INT0 feeds the decoder. Keep the
+ * probe's pulse from it, and leave a frame in progress alone.
+ */
+static bool Probe_MIT(void)
+{
+  uint8_t eimsk = EIMSK;
+  bool present;
+
+  if (!(eimsk & (1 << INT0)))
+    return Probe_Present(&TK_DDR, &TK_PORT, &TK_PIN, TK_KBDIN);
+
+  if (tiDecoder.busy)
+    return true;                // Sending, so certainly there.
+  EIMSK = eimsk & ~(1 << INT0);
+  present = Probe_Present(&TK_DDR, &TK_PORT, &TK_PIN, TK_KBDIN);
+  EIFR = (1 << INTF0);          // Forget the probe's own edges.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    // But not a start bit that began meanwhile.
+    if ((TI_PIN & TI_KBDIN) == LOW)
+      ExplorerDecoder_Edge(&tiDecoder, TCNT1, false);
   }
+  EIMSK = eimsk;
+  return present;
+}
 
-  for (i = 0; i < 16; i++) {
-    uint8_t keys, change;
-    keys = scDirectNKeyStates[i];
-    change = keys ^ scDirectKeyStates[i];
-    if (change == 0) continue;
-    scDirectKeyStates[i] = keys;
-    for (j = 0; j < 8; j++) {
-      if (change & (1 << j)) {
-        int code = (i * 8) + j;
-        if (keys & (1 << j)) {
-          KeyDown(&SpaceCadetKeys[code], false);
-        }
-        else {
-          KeyUp(&SpaceCadetKeys[code]);
-        }
-      }
-    }
+/** Find which keyboard is connected, taking well under 100 usec.
+ * The Knight and Space Cadet keyboards share a connector and only
+ * differ in the codes they send, so MIT_Read settles which one when
+ * the first key arrives. Until then, assume Space Cadet, whose slower
+ * clocking also works for Knight. TI uses the same data line and
+ * cannot be told apart at all, so it is only kept when preferred.
+ */
+static Keyboard Probe_Keyboard(Keyboard preferred)
+{
+  bool smbx, mit;
+
+  smbx = Probe_SMBX();
+  mit = Probe_MIT();
+
+  if (preferred == SMBX) {
+    if (smbx || !mit)
+      return SMBX;
+  }
+  else if ((preferred == TK) || (preferred == SPACE_CADET) || (preferred == TI)) {
+    if (mit || !smbx)
+      return preferred;
+  }
+  if (smbx)
+    return SMBX;
+  if (mit)
+    return SPACE_CADET;
+  return preferred;
+}
+
+static uint16_t ProbeLastTime;
+
+/** Periodically check that the keyboard is still there, and look for
+ * another one when it is not.
+ */
+static void Probe_Task(void)
+{
+  uint16_t now = Milliseconds();
+  bool present;
+
+  if ((uint16_t)(now - ProbeLastTime) < PROBE_INTERVAL_MS)
+    return;
+  ProbeLastTime = now;
+
+  switch (CurrentKeyboard) {
+  case SMBX:
+    present = Probe_SMBX();
+    break;
+  case TK:
+  case SPACE_CADET:
+  case TI:
+    present = Probe_MIT();
+    break;
+  default:
+    present = false;
+    break;
   }
+  if (present) return;
+
+  // Whatever was down on the old keyboard can never come up now.
+  ResetKeyState();
+
+  SelectKeyboard(Probe_Keyboard(CurrentKeyboard));
 }
 
 #endif
@@ -1295,7 +2894,7 @@ static const KeyInfo SMBXKeys[128] PROGMEM = {
   NO_KEY(012),
   NO_KEY(013),
   NO_KEY(014),
-  LISP_KEY(015, HID_KEYBOARD_SC_F12, KS_SM_015), /* select */
+  CONTROL_KEY(015, HID_KEYBOARD_SC_F12, CK_SELECT, KS_SM_015), /* select */
   SHIFT_KEY(016, HID_KEYBOARD_SC_INTERNATIONAL1, L_SYMBOL), /* left symbol */
   SHIFT_KEY(017, HID_KEYBOARD_SC_LEFT_GUI, L_SUPER), /* left super */
   SHIFT_KEY(020, HID_KEYBOARD_SC_LEFT_CONTROL, L_CONTROL), /* left control */
@@ -1313,7 +2912,7 @@ static const KeyInfo SMBXKeys[128] PROGMEM = {
   PC_KEY(034, HID_KEYBOARD_SC_DOT_AND_GREATER_THAN_SIGN, NULL), /* . */
   SHIFT_KEY(035, HID_KEYBOARD_SC_RIGHT_SHIFT, R_SHIFT), /* right shift */
   SHIFT_KEY(036, HID_KEYBOARD_SC_AGAIN, REPEAT), /* repeat */
-  LISP_KEY(037, HID_KEYBOARD_SC_STOP, KS_SM_037), /* abort */
+  CONTROL_KEY(037, HID_KEYBOARD_SC_STOP, CK_ABORT, KS_SM_037), /* abort */
   NO_KEY(040),
   NO_KEY(041),
   NO_KEY(042),
@@ -1324,7 +2923,7 @@ static const KeyInfo SMBXKeys[128] PROGMEM = {
   PC_KEY(047, HID_KEYBOARD_SC_COMMA_AND_LESS_THAN_SIGN, NULL), /* , */
   PC_KEY(050, HID_KEYBOARD_SC_SLASH_AND_QUESTION_MARK, NULL), /* / */
   SHIFT_KEY(051, HID_KEYBOARD_SC_INTERNATIONAL2, R_SYMBOL), /* right symbol */
-  LISP_KEY(052, HID_KEYBOARD_SC_HELP, KS_SM_052), /* help */
+  CONTROL_KEY(052, HID_KEYBOARD_SC_HELP, CK_HELP, KS_SM_052), /* help */
   NO_KEY(053),
   NO_KEY(054),
   NO_KEY(055),
@@ -1401,8 +3000,8 @@ static const KeyInfo SMBXKeys[128] PROGMEM = {
   LISP_KEY(163, HID_KEYBOARD_SC_F23, KS_SM_163), /* circle */
   LISP_KEY(164, HID_KEYBOARD_SC_F24, KS_SM_164), /* triangle */
   LISP_KEY(165, HID_KEYBOARD_SC_F8, KS_SM_165), /* clear input */
-  LISP_KEY(166, HID_KEYBOARD_SC_PAUSE, KS_SM_166), /* suspend */
-  LISP_KEY(167, HID_KEYBOARD_SC_F10, KS_SM_167), /* resume */
+  CONTROL_KEY(166, HID_KEYBOARD_SC_PAUSE, CK_SUSPEND, KS_SM_166), /* suspend */
+  CONTROL_KEY(167, HID_KEYBOARD_SC_F10, CK_RESUME, KS_SM_167), /* resume */
   NO_KEY(170),
   NO_KEY(171),
   NO_KEY(172),
@@ -1413,7 +3012,7 @@ static const KeyInfo SMBXKeys[128] PROGMEM = {
   NO_KEY(177)
 };
 
-static uint8_t smbxKeyStates[16], smbxNKeyStates[16];
+static uint8_t smbxKeyStates[SMBX_GROUPS];
 
 static inline void SMBX_Strobe(uint8_t pin)
 {
@@ -1434,47 +3033,58 @@ static void SMBX_Init(void)
   SMBX_DDR |= (SMBX_KBDSCAN | SMBX_KBDNEXT);
   SMBX_PORT |= (SMBX_KBDSCAN | SMBX_KBDNEXT | SMBX_KBDIN);
 
-  for (i = 0; i < 16; i++)
+  for (i = 0; i < SMBX_GROUPS; i++)
     smbxKeyStates[i] = 0;
 }
 
-static void SMBX_Scan(void)
+static void SMBX_Done(void)
 {
-  int i,j;
-  bool first = true;
+  SMBX_DDR &= ~(SMBX_KBDSCAN | SMBX_KBDNEXT);
+}
 
-  for (i = 0; i < 16; i++) {
-    uint8_t code = 0;
-    for (j = 0; j < 8; j++) {
-      SMBX_Strobe(first ? SMBX_KBDSCAN : SMBX_KBDNEXT);
-      if ((SMBX_PIN & SMBX_KBDIN) == LOW) {
-        code |= (1 << j);
-      }
-      first = false;
+/** Read the next eight keys, or the first eight when group is 0,
+ * and pass on any changes.
+ */
+static void SMBX_ScanGroup(uint8_t group)
+{
+  uint8_t keys = 0, change;
+  int j;
+
+  for (j = 0; j < 8; j++) {
+    SMBX_Strobe(((group == 0) && (j == 0)) ? SMBX_KBDSCAN : SMBX_KBDNEXT);
+    if ((SMBX_PIN & SMBX_KBDIN) == LOW) {
+      keys |= (1 << j);
     }
-    smbxNKeyStates[i] = code;
   }
 
-  for (i = 0; i < 16; i++) {
-    uint8_t keys, change;
-    keys = smbxNKeyStates[i];
-    change = keys ^ smbxKeyStates[i];
-    if (change == 0) continue;
-    smbxKeyStates[i] = keys;
-    for (j = 0; j < 8; j++) {
-      if (change & (1 << j)) {
-        int code = (i * 8) + j;
-        if (keys & (1 << j)) {
-          KeyDown(&SMBXKeys[code], false);
-        }
-        else {
-          KeyUp(&SMBXKeys[code]);
-        }
+  change = keys ^ smbxKeyStates[group];
+  if (change == 0) return;
+  smbxKeyStates[group] = keys;
+  for (j = 0; j < 8; j++) {
+    if (change & (1 << j)) {
+      int code = (group * 8) + j;
+      bool done;
+      TRACE(TRACE_SCAN_MATRIX, code, (keys >> j) & 1, 0);
+      if (keys & (1 << j)) {
+        done = KeyDown(&SMBXKeys[code], false);
       }
+      else {
+        done = KeyUp(&SMBXKeys[code]);
+      }
+      if (!done)
+        smbxKeyStates[group] ^= (1 << j); // Seen again next scan.
     }
   }
 }
 
+static void SMBX_Scan(void)
+{
+  uint8_t group;
+
+  for (group = 0; group < SMBX_GROUPS; group++)
+    SMBX_ScanGroup(group);
+}
+
 /*** TI Keyboards ***/
 
 KEYSYM(KS_TI_004, "boldlock");
@@ -1499,16 +3109,16 @@ KEYSYM(KS_TI_134, "line");
 
 static const KeyInfo ExplorerKeys[128] PROGMEM = {
   NO_KEY(000),
-  LISP_KEY(001, HID_KEYBOARD_SC_HELP, NULL), // HELP
+  CONTROL_KEY(001, HID_KEYBOARD_SC_HELP, CK_HELP, NULL), // HELP
   NO_KEY(002),
   SHIFT_KEY(003, HID_KEYBOARD_SC_CAPS_LOCK, CAPS_LOCK), // CAPS-LOCK
   LISP_KEY(004, HID_KEYBOARD_SC_MEDIA_VOLUME_DOWN, KS_TI_004), // BOLD-LOCK (shift key? LED?)
   LISP_KEY(005, HID_KEYBOARD_SC_MEDIA_MUTE, KS_TI_005), // ITAL-LOCK (shift key? LED?)
   SHIFT_KEY(006, HID_KEYBOARD_SC_SCROLL_LOCK, MODE_LOCK), // MODE-LOCK
   SHIFT_KEY(007, HID_KEYBOARD_SC_INTERNATIONAL5, L_HYPER), // LEFT-HYPER
-  LISP_KEY(010, HID_KEYBOARD_SC_F12, KS_TI_010), // SYSTEM
+  CONTROL_KEY(010, HID_KEYBOARD_SC_F12, CK_SELECT, KS_TI_010), // SYSTEM
   LISP_KEY(011, HID_KEYBOARD_SC_F13, KS_TI_011), // NETWORK
-  LISP_KEY(012, HID_KEYBOARD_SC_SYSREQ, KS_TI_012), // STATUS
+  CONTROL_KEY(012, HID_KEYBOARD_SC_SYSREQ, CK_STATUS, KS_TI_012), // STATUS
   LISP_KEY(013, HID_KEYBOARD_SC_OPER, KS_TI_013), // TERMINAL
   NO_KEY(014),
   LISP_KEY(015, HID_KEYBOARD_SC_F5, KS_TI_015), // CLEAR-SCREEN
@@ -1531,7 +3141,7 @@ static const KeyInfo ExplorerKeys[128] PROGMEM = {
   SHIFT_KEY(036, HID_KEYBOARD_SC_RIGHT_ALT, R_META), // RIGHT-META
   SHIFT_KEY(037, HID_KEYBOARD_SC_RIGHT_GUI, R_SUPER), // RIGHT-SUPER
   SHIFT_KEY(040, HID_KEYBOARD_SC_INTERNATIONAL6, R_HYPER), // RIGHT-HYPER
-  LISP_KEY(041, HID_KEYBOARD_SC_F10, KS_TI_041), // RESUME
+  CONTROL_KEY(041, HID_KEYBOARD_SC_F10, CK_RESUME, KS_TI_041), // RESUME
   NO_KEY(042),
   LISP_KEY(043, HID_KEYBOARD_SC_ESCAPE, KS_TI_043), // ALT (ESCAPE actually?)
   PC_KEY(044, HID_KEYBOARD_SC_1_AND_EXCLAMATION, NULL), // 1
@@ -1574,7 +3184,7 @@ static const KeyInfo ExplorerKeys[128] PROGMEM = {
   PC_KEY(111, HID_KEYBOARD_SC_KEYPAD_8_AND_UP_ARROW, NULL), // KEYPAD-8
   PC_KEY(112, HID_KEYBOARD_SC_KEYPAD_9_AND_PAGE_UP, NULL), // KEYPAD-9
   PC_KEY(113, HID_KEYBOARD_SC_KEYPAD_MINUS, NULL), // KEYPAD-MINUS
-  LISP_KEY(114, HID_KEYBOARD_SC_STOP, KS_TI_114), // ABORT
+  CONTROL_KEY(114, HID_KEYBOARD_SC_STOP, CK_ABORT, KS_TI_114), // ABORT
   NO_KEY(115),
   NO_KEY(116),
   PC_KEY(117, HID_KEYBOARD_SC_BACKSPACE, NULL), // RUBOUT
@@ -1628,6 +3238,58 @@ static const KeyInfo ExplorerKeys[128] PROGMEM = {
   PC_KEY(177, HID_KEYBOARD_SC_KEYPAD_ENTER, NULL) // KEYPAD-ENTER
 };
 
+/** The decoder is run from INT0 on each edge, with Timer1 as the clock,
+ * and its bytes turned into key transitions from the main loop.
+ * The framing and the meaning of the bytes are guesses, pending a
+ * capture from a real keyboard (see utils/lmkbd-decode): each byte
+ * is a key number, with the top bit set for key up.
+ */
+static ExplorerDecoder tiDecoder;
+
+static void TI_Init(void)
+{
+  TI_DDR &= ~TI_KBDIN;
+  TI_PORT |= TI_KBDIN;          // Enable pullup.
+
+  ExplorerDecoder_Init(&tiDecoder, TI_BIT_TICKS);
+
+  EICRA = (EICRA & ~((1 << ISC01) | (1 << ISC00))) | (1 << ISC00); // Any edge.
+  EIFR = (1 << INTF0);
+  EIMSK |= (1 << INT0);
+}
+
+static void TI_Done(void)
+{
+  EIMSK &= ~(1 << INT0);
+}
+
+ISR(INT0_vect)
+{
+  ExplorerDecoder_Edge(&tiDecoder, TCNT1, (TI_PIN & TI_KBDIN) != LOW);
+}
+
+static void TI_Task(void)
+{
+  uint16_t entry;
+  bool any;
+  uint8_t code;
+
+  while (true) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      ExplorerDecoder_Idle(&tiDecoder, TCNT1);
+      any = ExplorerDecoder_Get(&tiDecoder, &entry);
+    }
+    if (!any) break;
+    TRACE(TRACE_SCAN_TI, entry & 0xFF, (entry & EXPLORER_DECODER_ERROR) != 0, 0);
+    if (entry & EXPLORER_DECODER_ERROR) continue;
+    code = entry & 0x7F;
+    if (entry & 0x80)
+      KeyUp(&ExplorerKeys[code]);
+    else
+      KeyDown(&ExplorerKeys[code], false);
+  }
+}
+
 /*** Device Application ***/
 
 /** Main program entry point. This routine contains the overall program flow, including initial
@@ -1641,10 +3303,34 @@ int main(void)
   GlobalInterruptEnable();
 
   while (true) {
-    LMKBD_Task();
-    HID_Device_USBTask(&Keyboard_HID_Interface);
-    USB_USBTask();
+    if (USB_DeviceState == DEVICE_STATE_Suspended)
+      Suspend_Task();
+    PROFILE(PROFILE_LMKBD_TASK, LMKBD_Task());
+    PROFILE(PROFILE_HID_TASK, HID_Device_USBTask(&Keyboard_HID_Interface));
+    PROFILE(PROFILE_USB_TASK, USB_USBTask());
+  }
+}
+
+/** While the host is suspended, wait for an interrupt before each scan.
+ * Timer1 overflows every 32ms (at 16MHz), which is then the scan rate;
+ * the TI keyboard's edges and the host resuming wake it sooner.
+ * Scanner outputs are idle between scans, so nothing else need be parked.
+ */
+static void Suspend_Task(void)
+{
+  if (WakeupRequested) {
+    WakeupRequested = false;
+    if (USB_Device_RemoteWakeupEnabled) {
+      // The key stays down, and goes out once the host is listening.
+      USB_Device_SendRemoteWakeup();
+      return;
+    }
   }
+
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  sleep_cpu();
+  sleep_disable();
 }
 
 /** Configures the board hardware and keyboard pins. */
@@ -1702,14 +3388,118 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 /** Event handler for the library USB Control Request reception event. */
 void EVENT_USB_Device_ControlRequest(void)
 {
+  CachedReportValid = false;    // Such as SET_PROTOCOL.
   HID_Device_ProcessControlRequest(&Keyboard_HID_Interface);
 }
 
+/** Event handler for the library USB Suspend event. */
+void EVENT_USB_Device_Suspend(void)
+{
+  LEDs_SetAllLEDs(LEDS_NO_LEDS);
+#ifdef EXTERNAL_LEDS
+  SuspendedXLEDs = XLEDS_PORT & XLEDS_ALL;
+  XLEDS_PORT &= ~XLEDS_ALL;
+#endif
+  WakeupRequested = false;
+}
+
+/** Event handler for the library USB Wake Up event. */
+void EVENT_USB_Device_WakeUp(void)
+{
+  LEDs_SetAllLEDs(LEDMASK_USB_READY);
+#ifdef EXTERNAL_LEDS
+  XLEDS_PORT = (XLEDS_PORT & ~XLEDS_ALL) | SuspendedXLEDs;
+#endif
+}
+
 /** Event handler for the USB device Start Of Frame event. */
 void EVENT_USB_Device_StartOfFrame(void)
 {
   HID_Device_MillisecondElapsed(&Keyboard_HID_Interface);
+  MillisecondTicks++;
+}
+
+static void BuildKeyboardReport(USB_KeyboardReport_Data_t* KeyboardReport)
+{
+  if (NeedEmptyReport) {
+    NeedEmptyReport = false;
+#ifdef LMKBD_DUAL
+    // Only the keyboard that does not send key ups is released.
+    if (CurrentKeyboard != SMBX) {
+      uint8_t nkeys = 0;
+      AddKeyStateReport(&KeyStates[1], false, KeyboardReport, &nkeys);
+    }
+#endif
+  }
+  else if (!AddTranslationReport(KeyboardReport)) {
+    AddKeyReport(KeyboardReport);
+  }
+}
+
+#ifdef LMKBD_CONSUMER_KEYS
+/*** Consumer and System Control ***/
+
+static void Control_GetReports(ControlReports *reports)
+{
+  uint8_t nconsumer = 0;
+  uint8_t i, j;
+
+  memset(reports, 0, sizeof(*reports));
+  for (i = 0; i < N_KEY_STATES; i++) {
+#ifdef LMKBD_DUAL
+    if ((i > 0) && (CurrentKeyboard == SMBX)) break;
+#endif
+    for (j = 0; j < KeyStates[i].nKeysDown; j++) {
+      HidUsageID usage = KeyStates[i].keysDown[j];
+      const ControlKey *key;
+      if (!IS_CONTROL_KEY(usage)) continue;
+      key = &ControlKeys[usage - CONTROL_KEY_BASE];
+      if (pgm_read_byte(&key->reportID) == REPORT_ID_SYSTEM)
+        reports->system = (uint8_t)pgm_read_word(&key->usage);
+      else if (nconsumer < CONSUMER_REPORT_KEYS)
+        reports->consumer[nconsumer++] = pgm_read_word(&key->usage);
+    }
+  }
+}
+
+/** Fill in the Consumer or System Control report the host asked for,
+ * or else, when polled, whichever has changed since it was last sent.
+ * The keyboard report waits until both are up to date, so that a
+ * control key and a following ordinary key arrive in order; the caller
+ * likewise only polls here once no keyboard reports are owed.
+ */
+static bool Control_CreateReport(uint8_t* const ReportID, void* ReportData, uint16_t* const ReportSize)
+{
+  ControlReports reports;
+  uint8_t id = *ReportID;
+
+  Control_GetReports(&reports);
+  if (id == 0) {
+    if (memcmp(reports.consumer, SentControlReports.consumer, sizeof(reports.consumer)))
+      id = REPORT_ID_CONSUMER;
+    else if (reports.system != SentControlReports.system)
+      id = REPORT_ID_SYSTEM;
+  }
+
+  if (id == REPORT_ID_CONSUMER) {
+    memcpy(ReportData, reports.consumer, sizeof(reports.consumer));
+    *ReportSize = sizeof(reports.consumer);
+    memcpy(SentControlReports.consumer, reports.consumer, sizeof(reports.consumer));
+  }
+  else if (id == REPORT_ID_SYSTEM) {
+    *(uint8_t*)ReportData = reports.system;
+    *ReportSize = sizeof(reports.system);
+    SentControlReports.system = reports.system;
+  }
+  else
+    return false;
+
+  *ReportID = id;
+  ControlReportSent = true;
+  Stats_Report();
+  return true;
 }
+#endif
 
 /** HID class driver callback function for the creation of HID reports to the host.
  *
@@ -1733,16 +3523,51 @@ bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDIn
   case HID_REPORT_ITEM_In:
     {
       USB_KeyboardReport_Data_t* KeyboardReport = (USB_KeyboardReport_Data_t*)ReportData;
-      if (NeedEmptyReport) {
-        NeedEmptyReport = false;
+
+#ifdef LMKBD_CONSUMER_KEYS
+      // In boot protocol, there is only the keyboard report, without an ID.
+      // When polled, keyboard reports still owed go first, including
+      // the current one if it has not been built since a key changed,
+      // so that a control key does not overtake the keys before it.
+      if (Keyboard_HID_Interface.State.UsingReportProtocol) {
+        if (((*ReportID != 0) ||
+             (!TranslationPending() && !NeedEmptyReport && (KeyTransitionCount == 0) &&
+              !ScheduleChanged)) &&
+            Control_CreateReport(ReportID, ReportData, ReportSize))
+          return true;
+        *ReportID = REPORT_ID_KEYBOARD;
+      }
+      if (ControlReportSent) {
+        // Put back the last keyboard report, for comparison and for translation.
+        PrevKeyboardReport = CachedReport;
+        ControlReportSent = false;
       }
-      else if (EmacsBufferedCount > 0) {
-        AddEmacsReport(KeyboardReport);
+#endif
+      if (CachedReportValid && !NeedEmptyReport && !TranslationPending()) {
+        *KeyboardReport = CachedReport;
       }
       else {
-        AddKeyReport(KeyboardReport);
+        // Only a report of just the keys down can be sent again.
+        CachedReportValid = !NeedEmptyReport && !TranslationPending();
+        BuildKeyboardReport(KeyboardReport);
+        CachedReport = *KeyboardReport;
       }
       *ReportSize = sizeof(USB_KeyboardReport_Data_t);
+      Stats_Report();
+#ifdef LMKBD_TRACE
+      // Only those the library will actually send.
+      if (memcmp(KeyboardReport, &PrevKeyboardReport, sizeof(USB_KeyboardReport_Data_t)))
+        TRACE(TRACE_REPORT, KeyboardReport->Modifier,
+              KeyboardReport->KeyCode[0], KeyboardReport->KeyCode[1]);
+#endif
+      if (RepeatReleased) {
+        RepeatReleased = false;
+        Repeat_Press();
+      }
+#ifdef TK_SYNTHESIZE_KEYUPS
+      if (tkPendingPress)
+        TK_Press();
+#endif
     }
     return false;
   case HID_REPORT_ITEM_Feature:
@@ -1752,7 +3577,15 @@ bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDIn
       for (i = 0; i < N_MODES; i++) {
         FeatureReport[i+1] = (uint8_t)CurrentModes[i];
       }
-      *ReportSize = 3;
+      FeatureReport[N_MODES+1] = (uint8_t)CurrentModeLockMode;
+      FeatureReport[N_MODES+2] = EmacsBufferHighWater;
+      FeatureReport[N_MODES+3] = KeyTransitionHighWater;
+      FeatureReport[N_MODES+4] = QueueDrops;
+#ifdef FEATURE_PAGES
+      FeatureReport[N_MODES+5] = FeaturePage;
+      Feature_Page(FeaturePage, &FeatureReport[N_MODES+6]);
+#endif
+      *ReportSize = FEATURE_REPORT_SIZE;
     }
     return true;
   default:
@@ -1800,9 +3633,32 @@ void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const HIDI
   case HID_REPORT_ITEM_Feature:
     if (ReportSize > N_MODES) {
       uint8_t* FeatureReport = (uint8_t*)ReportData;
+      CachedReportValid = false;
+      if (FeatureReport[0] <= TI)
+        SelectKeyboard((Keyboard)FeatureReport[0]);
       for (i = 0; i < N_MODES; i++) {
-        CurrentModes[i] = (TranslationMode)FeatureReport[i+1];
+        // Anything else has no entry in TranslationOpsTable.
+        if ((FeatureReport[i+1] >= HUT1) &&
+            (FeatureReport[i+1] <= LAST_TRANSLATION_MODE))
+          CurrentModes[i] = (TranslationMode)FeatureReport[i+1];
       }
+      if ((ReportSize > N_MODES + 1) &&
+          (FeatureReport[N_MODES+1] <= MODE_LOCK_MODE_2_SILENT))
+        CurrentModeLockMode = (ModeLockMode)FeatureReport[N_MODES+1];
+#ifdef FEATURE_PAGES
+      // Only selects what the next GET returns, so nothing to save.
+      if (ReportSize > N_MODES + 5)
+        FeaturePage = FeatureReport[N_MODES+5];
+#endif
+#ifdef LMKBD_TRACE
+      FlightTrace.paused = ((FeaturePage & 0xF0) == FEATURE_PAGE_TRACE);
+      TraceReadTime = Milliseconds();
+#endif
+#ifdef LMKBD_PROFILE
+      if (FeaturePage == FEATURE_PAGE_PROFILE_RESET)
+        memset(ProfileCounters, 0, sizeof(ProfileCounters));
+#endif
+      Settings_Save();
     }
     break;
   }
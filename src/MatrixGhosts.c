@@ -0,0 +1,63 @@
+/*
+  Copyright 2014 Mike McMahon
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ * Possible phantom keys in a key matrix without diodes.
+ *
+ * This only looks at the rows down in each column, so the firmware
+ * runs it after every direct scan and the host can run it over
+ * recorded or made-up scans to check and time it.
+ */
+
+#include "MatrixGhosts.h"
+
+/** Find keys that might be phantoms in a matrix without diodes.
+ * When two columns have two or more rows down in common, any one of
+ * the four corners could come from the other three, so hold all of
+ * those rows in both columns as they were until the rectangle clears.
+ * Only columns with more than one key down can take part, and there
+ * are seldom more than one or two of those, so this is mostly just
+ * one test per column.
+ */
+void MatrixGhosts_Find(const uint8_t *keys, uint8_t *ghosts, uint8_t columns)
+{
+  uint8_t multi[MATRIX_GHOSTS_MAX_COLUMNS], nmulti;
+  uint8_t i, j, shared;
+
+  nmulti = 0;
+  for (i = 0; i < columns; i++) {
+    ghosts[i] = 0;
+    if (keys[i] & (keys[i] - 1)) // More than one bit.
+      multi[nmulti++] = i;
+  }
+
+  for (i = 0; i + 1 < nmulti; i++) {
+    for (j = i + 1; j < nmulti; j++) {
+      shared = keys[multi[i]] & keys[multi[j]];
+      if (shared & (shared - 1)) {
+        ghosts[multi[i]] |= shared;
+        ghosts[multi[j]] |= shared;
+      }
+    }
+  }
+}
@@ -0,0 +1,41 @@
+/*
+  Copyright 2014 Mike McMahon
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ * Header file for MatrixGhosts.c.
+ */
+
+#ifndef _MATRIX_GHOSTS_H_
+#define _MATRIX_GHOSTS_H_
+
+/* Includes: */
+#include <stdint.h>
+
+/* Macros: */
+/** Most columns a matrix can have. */
+#define MATRIX_GHOSTS_MAX_COLUMNS 16
+
+/* Function Prototypes: */
+void MatrixGhosts_Find(const uint8_t *keys, uint8_t *ghosts, uint8_t columns);
+
+#endif
@@ -0,0 +1,241 @@
+/*
+  Copyright 2014 Mike McMahon
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ * Direct scan of a key matrix, included once for each kind of matrix
+ * from Keyboard.c, after defining:
+ *
+ *  MATRIX_NAME           Prefix for functions, e.g. SpaceCadetDirect gives SpaceCadetDirect_Scan.
+ *  MATRIX_VAR(name)      Name for a state variable, e.g. scDirect##name.
+ *  MATRIX_COLUMNS        Number of columns driven.
+ *  MATRIX_KEYS           PROGMEM KeyInfo array, indexed by column * 8 + row.
+ *  MATRIX_SETTLE_US      Longest time for a column to settle before reading its rows.
+ *  MATRIX_INIT()         Set up pins, leaving no column selected.
+ *  MATRIX_DONE()         Put pins back as inputs.
+ *  MATRIX_SELECT(column) Drive the given column.
+ *  MATRIX_DESELECT()     Stop driving it.
+ *  MATRIX_ROWS()         Read the eight rows of the selected column, 1 for key down.
+ *
+ * and optionally MATRIX_GHOST_MASK, for a matrix without diodes, which
+ * holds back keys MatrixGhosts_Find says might be phantoms.
+ *
+ * Everything is static and the column count a constant, so each
+ * instance compiles to the same loop as one written out by hand.
+ */
+
+#define MATRIX_CAT2(a,b) a##_##b
+#define MATRIX_CAT(a,b) MATRIX_CAT2(a,b)
+#define MATRIX_FN(name) MATRIX_CAT(MATRIX_NAME,name)
+
+// Longest settling time, as iterations of _delay_loop_1 (3 cycles each).
+#if (F_CPU / 1000000UL) * MATRIX_SETTLE_US / 3 > 255
+#error MATRIX_SETTLE_US is longer than _delay_loop_1 can count
+#endif
+#define MATRIX_SETTLE_MAX ((uint8_t)((F_CPU / 1000000UL) * MATRIX_SETTLE_US / 3))
+
+#ifndef MATRIX_CALIBRATE_PASSES
+#define MATRIX_CALIBRATE_PASSES 8
+#endif
+
+// Mismatches within that many scans after which to calibrate again.
+#ifndef MATRIX_RECALIBRATE_MISMATCHES
+#define MATRIX_RECALIBRATE_MISMATCHES 16
+#endif
+#ifndef MATRIX_RECALIBRATE_SCANS
+#define MATRIX_RECALIBRATE_SCANS 256
+#endif
+
+static uint8_t MATRIX_VAR(KeyStates)[MATRIX_COLUMNS], MATRIX_VAR(NKeyStates)[MATRIX_COLUMNS];
+
+// Settling time found by calibration.
+static uint8_t MATRIX_VAR(Settle);
+// Columns that read differently twice in a row in the current window
+// of scans: settle time too short (e.g., the keyboard warming up), or
+// a bouncing key.
+static uint16_t MATRIX_VAR(Mismatches), MATRIX_VAR(WindowScans);
+// Calibration in progress: the settling time being tried, and how far
+// it has got with it.
+static bool MATRIX_VAR(Calibrating);
+static uint8_t MATRIX_VAR(TrySettle), MATRIX_VAR(TryColumn), MATRIX_VAR(TryPass);
+
+/** Read one column.
+ * Apart from the settling loop, this is a fixed number of cycles.
+ */
+static inline uint8_t MATRIX_FN(Read)(uint8_t column, uint8_t settle)
+{
+  uint8_t rows;
+
+  MATRIX_SELECT(column);
+
+  if (settle > 0)
+    _delay_loop_1(settle);
+
+  rows = MATRIX_ROWS();
+
+  MATRIX_DESELECT();
+  return rows;
+}
+
+/** Find the shortest settling time that reads the same as the longest,
+ * one column at a time, so that it can go on alongside scanning.
+ * Any key that changes meanwhile only makes the result longer, which
+ * is safe. The result is then doubled for margin.
+ */
+static void MATRIX_FN(CalibrateStart)(void)
+{
+  MATRIX_VAR(TrySettle) = MATRIX_VAR(TryColumn) = MATRIX_VAR(TryPass) = 0;
+  MATRIX_VAR(Calibrating) = true;
+}
+
+static void MATRIX_FN(CalibrateStep)(void)
+{
+  uint8_t settle = MATRIX_VAR(TrySettle);
+  uint8_t column = MATRIX_VAR(TryColumn);
+  uint16_t result;
+
+  if (settle < MATRIX_SETTLE_MAX) {
+    if (MATRIX_FN(Read)(column, settle) != MATRIX_FN(Read)(column, MATRIX_SETTLE_MAX)) {
+      // Too short: start over with the next.
+      MATRIX_VAR(TrySettle) = settle + 1;
+      MATRIX_VAR(TryColumn) = MATRIX_VAR(TryPass) = 0;
+      return;
+    }
+    if (++MATRIX_VAR(TryColumn) < MATRIX_COLUMNS)
+      return;
+    MATRIX_VAR(TryColumn) = 0;
+    if (++MATRIX_VAR(TryPass) < MATRIX_CALIBRATE_PASSES)
+      return;
+  }
+
+  result = (settle * 2) + 1;
+  if (result > MATRIX_SETTLE_MAX)
+    result = MATRIX_SETTLE_MAX;
+  MATRIX_VAR(Settle) = result;
+  MATRIX_VAR(Calibrating) = false;
+}
+
+static void MATRIX_FN(Calibrate)(void)
+{
+  MATRIX_FN(CalibrateStart)();
+  while (MATRIX_VAR(Calibrating))
+    MATRIX_FN(CalibrateStep)();
+}
+
+static void MATRIX_FN(Init)(void)
+{
+  int i;
+
+  MATRIX_INIT();
+
+  for (i = 0; i < MATRIX_COLUMNS; i++)
+    MATRIX_VAR(KeyStates)[i] = 0;
+  MATRIX_VAR(Mismatches) = MATRIX_VAR(WindowScans) = 0;
+
+  MATRIX_FN(Calibrate)();
+}
+
+static void MATRIX_FN(Done)(void)
+{
+  MATRIX_DONE();
+}
+
+#if defined(MATRIX_GHOST_MASK) && (MATRIX_COLUMNS > MATRIX_GHOSTS_MAX_COLUMNS)
+#error MATRIX_COLUMNS is more than MatrixGhosts_Find can take
+#endif
+
+static void MATRIX_FN(Scan)(void)
+{
+  int i,j;
+#ifdef MATRIX_GHOST_MASK
+  uint8_t ghosts[MATRIX_COLUMNS];
+#endif
+
+  for (i = 0; i < MATRIX_COLUMNS; i++) {
+    uint8_t keys = MATRIX_FN(Read)(i, MATRIX_VAR(Settle));
+    // Only believe a change that reads the same twice.
+    if ((keys != MATRIX_VAR(KeyStates)[i]) &&
+        (MATRIX_FN(Read)(i, MATRIX_VAR(Settle)) != keys)) {
+      MATRIX_VAR(Mismatches)++;
+      keys = MATRIX_VAR(KeyStates)[i]; // Try again next time.
+    }
+    MATRIX_VAR(NKeyStates)[i] = keys;
+  }
+
+  // More in a window than bounce accounts for suggests the settling
+  // time no longer suffices. Look again, a column per scan.
+  if (MATRIX_VAR(Calibrating)) {
+    MATRIX_FN(CalibrateStep)();
+  }
+  else if (++MATRIX_VAR(WindowScans) >= MATRIX_RECALIBRATE_SCANS) {
+    if (MATRIX_VAR(Mismatches) >= MATRIX_RECALIBRATE_MISMATCHES)
+      MATRIX_FN(CalibrateStart)();
+    MATRIX_VAR(Mismatches) = MATRIX_VAR(WindowScans) = 0;
+  }
+
+#ifdef MATRIX_GHOST_MASK
+  MatrixGhosts_Find(MATRIX_VAR(NKeyStates), ghosts, MATRIX_COLUMNS);
+#endif
+
+  for (i = 0; i < MATRIX_COLUMNS; i++) {
+    uint8_t keys, change;
+    keys = MATRIX_VAR(NKeyStates)[i];
+    change = keys ^ MATRIX_VAR(KeyStates)[i];
+#ifdef MATRIX_GHOST_MASK
+    change &= ~ghosts[i];
+    keys = MATRIX_VAR(KeyStates)[i] ^ change;
+#endif
+    if (change == 0) continue;
+    MATRIX_VAR(KeyStates)[i] = keys;
+    for (j = 0; j < 8; j++) {
+      if (change & (1 << j)) {
+        int code = (i * 8) + j;
+        bool done;
+        TRACE(TRACE_SCAN_MATRIX, code, (keys >> j) & 1, 0);
+        if (keys & (1 << j)) {
+          done = KeyDown(&MATRIX_KEYS[code], false);
+        }
+        else {
+          done = KeyUp(&MATRIX_KEYS[code]);
+        }
+        if (!done)
+          MATRIX_VAR(KeyStates)[i] ^= (1 << j); // Seen again next scan.
+      }
+    }
+  }
+}
+
+#undef MATRIX_NAME
+#undef MATRIX_VAR
+#undef MATRIX_COLUMNS
+#undef MATRIX_KEYS
+#undef MATRIX_SETTLE_US
+#undef MATRIX_INIT
+#undef MATRIX_DONE
+#undef MATRIX_SELECT
+#undef MATRIX_DESELECT
+#undef MATRIX_ROWS
+#undef MATRIX_CALIBRATE_PASSES
+#undef MATRIX_RECALIBRATE_MISMATCHES
+#undef MATRIX_RECALIBRATE_SCANS
+#undef MATRIX_GHOST_MASK
+#undef MATRIX_SETTLE_MAX
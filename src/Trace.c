@@ -0,0 +1,128 @@
+/*
+  Copyright 2014 Mike McMahon
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ * Flight recorder of recent firmware events.
+ *
+ * The firmware records into it and pages it out through the feature
+ * report; the host unpacks and formats the entries with the same code,
+ * and can record its own replay of a capture for comparison.
+ */
+
+#include <stdio.h>
+
+#include "Trace.h"
+
+void Trace_Init(Trace *trace)
+{
+  trace->next = 0;
+  trace->count = 0;
+  trace->paused = false;
+}
+
+void Trace_Add(Trace *trace, uint16_t time, uint8_t type, uint8_t a, uint8_t b, uint8_t c)
+{
+  TraceEntry *entry;
+
+  if (trace->paused) return;
+
+  entry = &trace->entries[trace->next];
+  entry->time = time;
+  entry->type = type;
+  entry->data[0] = a;
+  entry->data[1] = b;
+  entry->data[2] = c;
+  trace->next = (trace->next + 1) % TRACE_ENTRIES;
+  if (trace->count < TRACE_ENTRIES)
+    trace->count++;
+}
+
+/** Get an entry by age, oldest first. */
+bool Trace_Get(const Trace *trace, uint8_t index, TraceEntry *entry)
+{
+  if (index >= trace->count) return false;
+  *entry = trace->entries[(trace->next + TRACE_ENTRIES - trace->count + index) % TRACE_ENTRIES];
+  return true;
+}
+
+/** Put into the little-endian form sent to the host. */
+void Trace_Pack(const TraceEntry *entry, uint8_t *bytes)
+{
+  bytes[0] = entry->time & 0xFF;
+  bytes[1] = entry->time >> 8;
+  bytes[2] = entry->type;
+  bytes[3] = entry->data[0];
+  bytes[4] = entry->data[1];
+  bytes[5] = entry->data[2];
+}
+
+void Trace_Unpack(const uint8_t *bytes, TraceEntry *entry)
+{
+  entry->time = bytes[0] | ((uint16_t)bytes[1] << 8);
+  entry->type = bytes[2];
+  entry->data[0] = bytes[3];
+  entry->data[1] = bytes[4];
+  entry->data[2] = bytes[5];
+}
+
+static const char *TraceModeName(uint8_t mode)
+{
+  switch (mode) {
+  case 1: return "HUT";
+  case 2: return "Emacs";
+  case 3: return "Unicode";
+  default: return "?";
+  }
+}
+
+/** Describe an entry, without its time, so that traces can be diffed. */
+int Trace_Format(const TraceEntry *entry, char *buffer, size_t size)
+{
+  const uint8_t *data = entry->data;
+
+  switch (entry->type) {
+  case TRACE_SCAN_MIT:
+    return snprintf(buffer, size, "scan mit %03o %03o %03o", data[0], data[1], data[2]);
+  case TRACE_SCAN_MATRIX:
+    return snprintf(buffer, size, "scan matrix %03o %s", data[0], data[1] ? "down" : "up");
+  case TRACE_SCAN_TI:
+    return snprintf(buffer, size, "scan ti %03o%s", data[0], data[1] ? " framing error" : "");
+  case TRACE_KEY_DOWN:
+  case TRACE_KEY_UP:
+    return snprintf(buffer, size, "key %s 0x%02X shift %d%s%s%s",
+                    (entry->type == TRACE_KEY_DOWN) ? "down" : "up", data[0], data[1],
+                    (data[2] & TRACE_FLAG_HELD) ? " held" : "",
+                    (data[2] & TRACE_FLAG_CAUGHT_UP) ? " caught up" : "",
+                    (data[2] & TRACE_FLAG_NO_KEY_UPS) ? " no key ups" : "");
+  case TRACE_QUEUE:
+    return snprintf(buffer, size, "queue %s %d", TraceModeName(data[0]), data[1]);
+  case TRACE_DEQUEUE:
+    return snprintf(buffer, size, "dequeue %s %d", TraceModeName(data[0]), data[1]);
+  case TRACE_DROP:
+    return snprintf(buffer, size, "drop %s", TraceModeName(data[0]));
+  case TRACE_REPORT:
+    return snprintf(buffer, size, "report %02X %02X %02X", data[0], data[1], data[2]);
+  default:
+    return snprintf(buffer, size, "unknown %d %02X %02X %02X", entry->type, data[0], data[1], data[2]);
+  }
+}
@@ -0,0 +1,88 @@
+/*
+  Copyright 2014 Mike McMahon
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ * Header file for Trace.c.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* Includes: */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Macros: */
+/** Number of entries kept, oldest overwritten first. */
+#ifndef TRACE_ENTRIES
+#define TRACE_ENTRIES 64
+#endif
+
+/** Size in bytes of an entry as read from the keyboard. */
+#define TRACE_ENTRY_SIZE 6
+
+/* Type Defines: */
+/** What an entry records, and so what its three data bytes mean. */
+typedef enum {
+  TRACE_NONE = 0,
+  TRACE_SCAN_MIT,               // The three bytes of a Knight or Space Cadet code.
+  TRACE_SCAN_MATRIX,            // Symbolics or direct scan: key number, down.
+  TRACE_SCAN_TI,                // Decoded byte, framing error.
+  TRACE_KEY_DOWN,               // HID usage, shift, TRACE_FLAG_*.
+  TRACE_KEY_UP,                 // HID usage, shift, TRACE_FLAG_*.
+  TRACE_QUEUE,                  // Translation mode, events queued after.
+  TRACE_DEQUEUE,                // Translation mode, events queued after.
+  TRACE_DROP,                   // Translation mode.
+  TRACE_REPORT                  // Modifiers, first two keys.
+} TraceType;
+
+/** Flags for key transitions. */
+#define TRACE_FLAG_HELD 0x01    // Held until the translation queue has room.
+#define TRACE_FLAG_CAUGHT_UP 0x02 // A held one being done now.
+#define TRACE_FLAG_NO_KEY_UPS 0x04
+
+/** One event. Times are in whatever unit the caller's clock counts, and wrap. */
+typedef struct {
+  uint16_t time;
+  uint8_t type;
+  uint8_t data[3];
+} TraceEntry;
+
+/** A circular buffer of the most recent events. */
+typedef struct {
+  TraceEntry entries[TRACE_ENTRIES];
+  uint8_t next;                 // Where the next entry goes.
+  uint8_t count;
+  bool paused;                  // While being read.
+} Trace;
+
+/* Function Prototypes: */
+void Trace_Init(Trace *trace);
+void Trace_Add(Trace *trace, uint16_t time, uint8_t type, uint8_t a, uint8_t b, uint8_t c);
+bool Trace_Get(const Trace *trace, uint8_t index, TraceEntry *entry);
+void Trace_Pack(const TraceEntry *entry, uint8_t *bytes);
+void Trace_Unpack(const uint8_t *bytes, TraceEntry *entry);
+int Trace_Format(const TraceEntry *entry, char *buffer, size_t size);
+
+#endif
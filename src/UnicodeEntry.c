@@ -0,0 +1,89 @@
+/*
+  Copyright 2014 Mike McMahon
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ * Reports for the Ctrl+Shift+U hex entry of a Unicode character.
+ *
+ * Kept apart from the rest of the Unicode mode so that the host can
+ * send the same reports through uhid and check what arrives.
+ */
+
+#include "UnicodeEntry.h"
+
+// HID usages and modifiers, from HUT1.
+#define USAGE_A 0x04
+#define USAGE_U 0x18
+#define USAGE_1 0x1E
+#define USAGE_0 0x27
+#define USAGE_SPACE 0x2C
+#define MODIFIER_LEFTCTRL 0x01
+#define MODIFIER_LEFTSHIFT 0x02
+
+/** The next report of the entry of code: C-S-u, each hex digit, then
+ * space. stage counts them off from 0. A key that is still down from
+ * the last report, prevKey, is released in this one and pressed in the
+ * next. False once there is nothing left to send.
+ */
+bool UnicodeEntry_Next(uint16_t code, uint8_t *stage, uint8_t prevKey,
+                       uint8_t *modifier, uint8_t *key)
+{
+  uint8_t ndigits, digit, next;
+
+  if (code >= 0x1000)
+    ndigits = 4;
+  else if (code >= 0x100)
+    ndigits = 3;
+  else if (code >= 0x10)
+    ndigits = 2;
+  else
+    ndigits = 1;
+
+  if (*stage == 0) {
+    next = USAGE_U;
+  }
+  else if (*stage <= ndigits) {
+    digit = (code >> (4 * (ndigits - *stage))) & 0x0F;
+    if (digit == 0)
+      next = USAGE_0;
+    else if (digit < 10)
+      next = USAGE_1 + (digit - 1);
+    else
+      next = USAGE_A + (digit - 10);
+  }
+  else if (*stage == ndigits + 1) {
+    next = USAGE_SPACE;
+  }
+  else {
+    return false;
+  }
+
+  *modifier = 0;
+  *key = 0;
+  if (next == prevKey)
+    return true;
+  if (*stage == 0)
+    *modifier = MODIFIER_LEFTCTRL | MODIFIER_LEFTSHIFT;
+  *key = next;
+  (*stage)++;
+  return true;
+}
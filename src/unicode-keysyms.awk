@@ -0,0 +1,65 @@
+# Write UnicodeKeysyms.h, the Unicode mode's keysym table, from
+# lmkbd-graphic-keysyms in emacs/lmkbd.el, e.g.
+#   awk -f unicode-keysyms.awk ../emacs/lmkbd.el > UnicodeKeysyms.h
+# Each entry there is (keysym #xCODE [#xSHIFTED]) on a line of its own.
+
+BEGIN { n = 0 }
+
+/^\(defconst lmkbd-graphic-keysyms/ { inside = 1; next }
+inside && /^[ \t]*"/ { inside = 0 }
+inside {
+  sub(/;.*/, "")
+  gsub(/[()']/, " ")
+  if (NF == 0) next
+  if ((NF > 3) || ($2 !~ /^#x[0-9A-Fa-f]+$/) || ((NF == 3) && ($3 !~ /^#x[0-9A-Fa-f]+$/))) {
+    print FILENAME ":" FNR ": cannot parse keysym entry" > "/dev/stderr"
+    failed = 1
+    exit 1
+  }
+  names[n] = $1
+  codes[n] = toupper(substr($2, 3))
+  shifted[n] = (NF == 3) ? toupper(substr($3, 3)) : "0"
+  n++
+}
+
+function hex4(digits) {
+  while (length(digits) < 4) digits = "0" digits
+  return "0x" digits
+}
+
+END {
+  if (failed) exit 1
+  if (n == 0) {
+    print "no lmkbd-graphic-keysyms found" > "/dev/stderr"
+    exit 1
+  }
+  # In byte order, as strcmp would have them.
+  for (i = 1; i < n; i++) {
+    for (j = i; (j > 0) && (names[j-1] > names[j]); j--) {
+      t = names[j]; names[j] = names[j-1]; names[j-1] = t
+      t = codes[j]; codes[j] = codes[j-1]; codes[j-1] = t
+      t = shifted[j]; shifted[j] = shifted[j-1]; shifted[j-1] = t
+    }
+  }
+
+  print "/* Generated from emacs/lmkbd.el by src/unicode-keysyms.awk; do not edit. */"
+  print ""
+  print "// Keysym names, in order, each ending with NUL."
+  print "static const char UnicodeKeysymNames[] PROGMEM ="
+  line = " "
+  for (i = 0; i < n; i++) {
+    item = " \"" names[i] "\\0\""
+    if (length(line) + length(item) > 72) {
+      print line
+      line = " "
+    }
+    line = line item
+  }
+  print line ";"
+  print ""
+  print "// Codepoint for each name, unshifted and shifted (0 if the same)."
+  print "static const uint16_t UnicodeKeysymCodes[][2] PROGMEM = {"
+  for (i = 0; i < n; i++)
+    printf "  { %s, %s }%s  // %s\n", hex4(codes[i]), hex4(shifted[i]), (i < n - 1) ? "," : " ", names[i]
+  print "};"
+}
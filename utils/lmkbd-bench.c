@@ -0,0 +1,394 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lmkbd-bench.h"
+
+// Keyboard input report: modifiers, reserved, then up to six keys.
+#define REPORT_SIZE 8
+#define REPORT_KEYS 6
+
+// With LMKBD_CONSUMER_KEYS, reports start with an ID: the keyboard's,
+// then Consumer (two 16-bit usages) and System Control (one 8-bit).
+#define REPORT_ID_KEYBOARD 1
+#define REPORT_ID_CONSUMER 2
+#define REPORT_ID_SYSTEM 3
+#define CONTROL_REPORT_SIZE 4
+
+#define MODIFIER_CTRL 0x11
+#define MODIFIER_SHIFT 0x22
+
+// Inter-report intervals, in buckets doubling from 125us.
+#define N_INTERVAL_BUCKETS 14
+#define INTERVAL_FIRST_US 125
+
+// Reports per event and events per second, counted exactly up to here.
+#define MAX_REPORTS_PER_EVENT 32
+#define MAX_EVENTS_PER_SECOND 64
+
+// Where an Emacs escape sequence has got to: c-X @ prefix characters,
+// then optionally a keysym name ending with RET. Or a Unicode entry:
+// C-S-u, hex digits, then space.
+typedef enum {
+  SEQUENCE_NONE, SEQUENCE_CX, SEQUENCE_AT, SEQUENCE_KEYSYM, SEQUENCE_UNICODE
+} SequenceState;
+
+typedef struct {
+  unsigned char prev[REPORT_SIZE];
+  unsigned char prev_consumer[CONTROL_REPORT_SIZE], prev_system;
+  double first, last;
+  unsigned long reports;
+  unsigned long intervals[N_INTERVAL_BUCKETS];
+  double min_interval, max_interval;
+
+  SequenceState state;
+  char prefixes[16];            // Letters after each c-X @.
+  int nprefixes;
+  char keysym[64];
+  int nkeysym;
+  unsigned reports_since_event;
+  unsigned long events;
+  unsigned long reports_per_event[MAX_REPORTS_PER_EVENT + 1];
+
+  double second_start;
+  unsigned events_this_second;
+  unsigned long events_per_second[MAX_EVENTS_PER_SECOND + 1];
+
+  bool verbose;
+} Bench;
+
+static void bench_init(Bench *bench, bool verbose)
+{
+  memset(bench, 0, sizeof(*bench));
+  bench->min_interval = -1;
+  bench->verbose = verbose;
+}
+
+/** The character a key gives, as far as the firmware uses them in sequences. */
+static char usage_char(unsigned char usage, bool shift)
+{
+  if ((usage >= 0x04) && (usage <= 0x1D))
+    return (shift ? 'A' : 'a') + (usage - 0x04);
+  if (usage == 0x1F)
+    return shift ? '@' : '2';
+  if ((usage >= 0x1E) && (usage <= 0x26))
+    return '1' + (usage - 0x1E);
+  if (usage == 0x27)
+    return '0';
+  if (usage == 0x2D)
+    return shift ? '_' : '-';
+  if (usage == 0x28)
+    return '\n';
+  if (usage == 0x2C)
+    return ' ';
+  return 0;
+}
+
+static void bench_second(Bench *bench, double time)
+{
+  // Whole seconds from the first event, including ones with none.
+  while (time - bench->second_start >= 1.0) {
+    unsigned n = bench->events_this_second;
+    bench->events_per_second[(n > MAX_EVENTS_PER_SECOND) ? MAX_EVENTS_PER_SECOND : n]++;
+    bench->events_this_second = 0;
+    bench->second_start += 1.0;
+  }
+}
+
+static void bench_event(Bench *bench, double time, unsigned char usage, const char *what)
+{
+  unsigned n = bench->reports_since_event;
+
+  if (bench->events == 0)
+    bench->second_start = time;
+  bench_second(bench, time);
+  bench->events++;
+  bench->events_this_second++;
+  bench->reports_per_event[(n > MAX_REPORTS_PER_EVENT) ? MAX_REPORTS_PER_EVENT : n]++;
+  bench->reports_since_event = 0;
+
+  if (bench->verbose) {
+    printf("%12.6f %2u %.*s", time - bench->first, n, bench->nprefixes, bench->prefixes);
+    if (what != NULL)
+      printf(" %s\n", what);
+    else
+      printf(" 0x%02X\n", usage);
+  }
+  bench->nprefixes = 0;
+}
+
+/** A key has just gone down. */
+static void bench_key(Bench *bench, double time, unsigned char usage, unsigned char modifiers)
+{
+  char ch = usage_char(usage, (modifiers & MODIFIER_SHIFT) != 0);
+  bool ctrl = (modifiers & MODIFIER_CTRL) != 0;
+
+  switch (bench->state) {
+  case SEQUENCE_CX:
+    if (ch == '@') {
+      bench->state = SEQUENCE_AT;
+      return;
+    }
+    // That c-X was just itself.
+    bench->state = SEQUENCE_NONE;
+    bench_event(bench, time, 0x1B, "C-x");
+    break;
+  case SEQUENCE_AT:
+    if (ch == 'k') {
+      bench->state = SEQUENCE_KEYSYM;
+      bench->nkeysym = 0;
+    }
+    else {
+      bench->state = SEQUENCE_NONE;
+      if (bench->nprefixes < sizeof(bench->prefixes))
+        bench->prefixes[bench->nprefixes++] = ch;
+    }
+    return;
+  case SEQUENCE_KEYSYM:
+    if (ch == '\n') {
+      bench->keysym[bench->nkeysym] = '\0';
+      bench->state = SEQUENCE_NONE;
+      bench_event(bench, time, usage, bench->keysym);
+    }
+    else if ((ch != 0) && (bench->nkeysym < sizeof(bench->keysym) - 1)) {
+      bench->keysym[bench->nkeysym++] = ch;
+    }
+    return;
+  case SEQUENCE_UNICODE:
+    if (ch == ' ') {
+      bench->keysym[bench->nkeysym] = '\0';
+      bench->state = SEQUENCE_NONE;
+      bench_event(bench, time, usage, bench->keysym);
+    }
+    else if ((ch != 0) && (bench->nkeysym < sizeof(bench->keysym) - 1)) {
+      bench->keysym[bench->nkeysym++] = ch;
+    }
+    return;
+  default:
+    break;
+  }
+
+  if (ctrl && (ch == 'x')) {
+    bench->state = SEQUENCE_CX;
+    return;
+  }
+  if (ctrl && (ch == 'U')) {
+    bench->state = SEQUENCE_UNICODE;
+    strcpy(bench->keysym, "U+");
+    bench->nkeysym = 2;
+    return;
+  }
+  bench_event(bench, time, usage, NULL);
+}
+
+/** A Consumer or System Control report; each usage newly there is an event. */
+static void bench_control(Bench *bench, double time, const unsigned char *report, int size)
+{
+  char what[32];
+  int i, j;
+
+  if ((report[0] == REPORT_ID_CONSUMER) && (size > CONTROL_REPORT_SIZE)) {
+    for (i = 1; i <= CONTROL_REPORT_SIZE; i += 2) {
+      unsigned usage = report[i] | (report[i + 1] << 8);
+      if (usage == 0) continue;
+      for (j = 0; j < CONTROL_REPORT_SIZE; j += 2) {
+        if ((bench->prev_consumer[j] | (bench->prev_consumer[j + 1] << 8)) == usage) break;
+      }
+      if (j < CONTROL_REPORT_SIZE) continue;
+      snprintf(what, sizeof(what), "consumer 0x%03X", usage);
+      bench_event(bench, time, 0, what);
+    }
+    memcpy(bench->prev_consumer, report + 1, CONTROL_REPORT_SIZE);
+  }
+  else if ((report[0] == REPORT_ID_SYSTEM) && (size > 1)) {
+    if ((report[1] != 0) && (report[1] != bench->prev_system)) {
+      snprintf(what, sizeof(what), "system 0x%02X", report[1]);
+      bench_event(bench, time, 0, what);
+    }
+    bench->prev_system = report[1];
+  }
+}
+
+static void bench_report(Bench *bench, double time, const unsigned char *report, int size)
+{
+  bool control = false;
+  int i, j;
+
+  if ((size == REPORT_SIZE + 1) && (report[0] == REPORT_ID_KEYBOARD)) {
+    report++;
+    size--;
+  }
+  else if ((size < REPORT_SIZE) && (size > 1)) {
+    control = (report[0] == REPORT_ID_CONSUMER) || (report[0] == REPORT_ID_SYSTEM);
+    if (!control) return;
+  }
+  else if (size < REPORT_SIZE) return;
+
+  if (bench->reports == 0) {
+    bench->first = time;
+  }
+  else {
+    double interval = time - bench->last;
+    double limit = INTERVAL_FIRST_US * 1e-6;
+    for (i = 0; i < N_INTERVAL_BUCKETS - 1; i++) {
+      if (interval < limit) break;
+      limit *= 2;
+    }
+    bench->intervals[i]++;
+    if ((bench->min_interval < 0) || (interval < bench->min_interval))
+      bench->min_interval = interval;
+    if (interval > bench->max_interval)
+      bench->max_interval = interval;
+  }
+  bench->last = time;
+  bench->reports++;
+  bench->reports_since_event++;
+
+  if (control) {
+    bench_control(bench, time, report, size);
+    return;
+  }
+
+  for (i = 2; i < 2 + REPORT_KEYS; i++) {
+    if (report[i] < 4) continue;  // None or error.
+    for (j = 2; j < 2 + REPORT_KEYS; j++) {
+      if (bench->prev[j] == report[i]) break;
+    }
+    if (j < 2 + REPORT_KEYS) continue; // Still down.
+    bench_key(bench, time, report[i], report[0]);
+  }
+  memcpy(bench->prev, report, REPORT_SIZE);
+}
+
+static void bench_print(Bench *bench)
+{
+  int i;
+
+  if (bench->reports < 2) {
+    printf("Not enough reports.\n");
+    return;
+  }
+
+  printf("Reports = %lu over %.3fs\n", bench->reports, bench->last - bench->first);
+  printf("Interval min %.3fms, mean %.3fms, max %.3fms\n",
+         bench->min_interval * 1e3,
+         (bench->last - bench->first) * 1e3 / (bench->reports - 1),
+         bench->max_interval * 1e3);
+  for (i = 0; i < N_INTERVAL_BUCKETS; i++) {
+    unsigned long limit = (unsigned long)INTERVAL_FIRST_US << i;
+    if (bench->intervals[i] == 0) continue;
+    if (i < N_INTERVAL_BUCKETS - 1)
+      printf("  < %8luus %8lu\n", limit, bench->intervals[i]);
+    else
+      printf("  >=%8luus %8lu\n", limit / 2, bench->intervals[i]);
+  }
+
+  if (bench->events == 0) return;
+  bench_second(bench, bench->last);
+  if (bench->events_this_second > 0) {
+    // Count the partial second at the end, too.
+    unsigned n = bench->events_this_second;
+    bench->events_per_second[(n > MAX_EVENTS_PER_SECOND) ? MAX_EVENTS_PER_SECOND : n]++;
+  }
+
+  printf("Events = %lu, %.2f reports each\n", bench->events,
+         (double)bench->reports / bench->events);
+  printf("Reports per event:\n");
+  for (i = 0; i <= MAX_REPORTS_PER_EVENT; i++) {
+    if (bench->reports_per_event[i] == 0) continue;
+    printf("  %s%3d %8lu\n", (i < MAX_REPORTS_PER_EVENT) ? "  " : ">=", i,
+           bench->reports_per_event[i]);
+  }
+  printf("Events per second:\n");
+  for (i = 0; i <= MAX_EVENTS_PER_SECOND; i++) {
+    if (bench->events_per_second[i] == 0) continue;
+    printf("  %s%3d %8lu\n", (i < MAX_EVENTS_PER_SECOND) ? "  " : ">=", i,
+           bench->events_per_second[i]);
+  }
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void bench_interrupt(int sig)
+{
+  interrupted = 1;
+}
+
+int bench_device(int fd, FILE *record, bool verbose)
+{
+  Bench bench;
+  struct sigaction action;
+
+  bench_init(&bench, verbose);
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = bench_interrupt;
+  sigaction(SIGINT, &action, NULL);
+  fprintf(stderr, "Type on the keyboard; interrupt to finish.\n");
+
+  while (!interrupted) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    unsigned char report[64];
+    struct timespec now;
+    int rc, i;
+
+    rc = poll(&pfd, 1, -1);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      perror("Error waiting for report");
+      return 1;
+    }
+    rc = read(fd, report, sizeof(report));
+    // Stamp as soon as possible after the read returns.
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (rc < 0) {
+      if ((errno == EAGAIN) || (errno == EINTR)) continue;
+      perror("Error reading report");
+      return 1;
+    }
+    if (record != NULL) {
+      fprintf(record, "%ld.%09ld", (long)now.tv_sec, now.tv_nsec);
+      for (i = 0; i < rc; i++)
+        fprintf(record, " %02x", report[i]);
+      fprintf(record, "\n");
+    }
+    bench_report(&bench, now.tv_sec + now.tv_nsec * 1e-9, report, rc);
+  }
+
+  bench_print(&bench);
+  return 0;
+}
+
+int bench_capture(FILE *in, bool verbose)
+{
+  Bench bench;
+  char line[256];
+
+  bench_init(&bench, verbose);
+  while (fgets(line, sizeof(line), in) != NULL) {
+    unsigned char report[64];
+    char *field, *end;
+    double time;
+    int size = 0;
+
+    time = strtod(line, &end);
+    if (end == line) continue;  // Comment or blank.
+    field = end;
+    while (size < sizeof(report)) {
+      unsigned long byte = strtoul(field, &end, 16);
+      if (end == field) break;
+      report[size++] = byte;
+      field = end;
+    }
+    bench_report(&bench, time, report, size);
+  }
+
+  bench_print(&bench);
+  return 0;
+}
@@ -0,0 +1,14 @@
+
+#ifndef _LMKBD_BENCH_H_
+#define _LMKBD_BENCH_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Time input reports as the host gets them, either live from the
+// hidraw device or from a capture made earlier with --record.
+// Returns a process exit status.
+int bench_device(int fd, FILE *record, bool verbose);
+int bench_capture(FILE *in, bool verbose);
+
+#endif
@@ -0,0 +1,152 @@
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "ExplorerDecoder.h"
+#include "Trace.h"
+
+// Run the firmware's TI Explorer decoder over a logic analyzer capture
+// exported as CSV: time in seconds, then one or more channel levels,
+// one row per change. Times are fed to the decoder in microseconds.
+// With --trace, the bytes are printed as the firmware's trace shows
+// them, for comparison with lmkbd-mode --trace --no-times.
+
+static int baud = 1200;
+static int column = 1;
+static int verbose = 0;
+static int trace = 0;
+
+static struct option long_options[] = {
+  {"baud", required_argument, 0, 'b'},
+  {"column", required_argument, 0, 'c'},
+  {"verbose", no_argument, &verbose, 1},
+  {"trace", no_argument, &trace, 1},
+  {NULL, 0, 0, 0}
+};
+
+static void print_entries(ExplorerDecoder *decoder, double time)
+{
+  uint16_t entry;
+
+  while (ExplorerDecoder_Get(decoder, &entry)) {
+    if (trace) {
+      TraceEntry trace_entry = {
+        0, TRACE_SCAN_TI, { entry & 0xFF, (entry & EXPLORER_DECODER_ERROR) != 0, 0 }
+      };
+      char line[64];
+      Trace_Format(&trace_entry, line, sizeof(line));
+      printf("%s\n", line);
+    }
+    else if (entry & EXPLORER_DECODER_ERROR) {
+      printf("%12.6f %03o framing error\n", time, entry & 0xFF);
+    }
+    else {
+      printf("%12.6f %03o %s %03o\n", time, entry,
+             (entry & 0x80) ? "up  " : "down", entry & 0x7F);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  while (true) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "b:c:v",
+                        long_options, &option_index);
+
+    if (c < 0) break;
+
+    if (c == 0) {
+      if (long_options[option_index].flag != 0) continue;
+      c = long_options[option_index].val;
+    }
+
+    switch (c) {
+    case 'b':
+      baud = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'c':
+      column = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'v':
+      verbose = 1;
+      break;
+
+    case '?':
+    default:
+      printf("Usage: %s [--baud rate] [--column num] [--verbose] [--trace] [file.csv]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if ((baud <= 0) || (baud > 1000000) || (column < 1)) {
+    fprintf(stderr, "Bad baud rate or column.\n");
+    return 1;
+  }
+
+  FILE *in = stdin;
+  if (optind < argc) {
+    in = fopen(argv[optind], "r");
+    if (in == NULL) {
+      perror("Unable to open capture");
+      return 1;
+    }
+  }
+
+  ExplorerDecoder decoder;
+  ExplorerDecoder_Init(&decoder, 1000000 / baud);
+
+  char line[1024];
+  bool started = false, level = true;
+  double time = 0, last = 0, shortest = 0;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    char *field, *end;
+    int i;
+    bool new_level;
+
+    time = strtod(line, &end);
+    if (end == line) continue;  // Header.
+    field = end;
+    for (i = 0; i < column; i++) {
+      field = strchr(field, ',');
+      if (field == NULL) break;
+      field++;
+    }
+    if (field == NULL) continue;
+    new_level = strtol(field, NULL, 10) != 0;
+
+    if (started && (new_level == level)) continue;
+    if (started) {
+      double width = time - last;
+      if ((shortest == 0) || (width < shortest)) shortest = width;
+      // Let the decoder finish a frame before a long gap wraps its clock.
+      double gap = (width < 0.06) ? width : 0.06;
+      ExplorerDecoder_Idle(&decoder, (uint16_t)(long long)((last + gap) * 1e6));
+      print_entries(&decoder, last + gap);
+    }
+    if (verbose) {
+      printf("%12.6f %d\n", time, new_level);
+    }
+    ExplorerDecoder_Edge(&decoder, (uint16_t)(long long)(time * 1e6), new_level);
+    print_entries(&decoder, time);
+    started = true;
+    level = new_level;
+    last = time;
+  }
+  ExplorerDecoder_Idle(&decoder, (uint16_t)(long long)((last + 0.06) * 1e6));
+  print_entries(&decoder, last);
+
+  if (decoder.overruns > 0) {
+    fprintf(stderr, "%d bytes lost.\n", decoder.overruns);
+  }
+  if ((shortest > 0) && !trace) {
+    printf("Shortest pulse %.1fus, about %.0f baud.\n", shortest * 1e6, 1 / shortest);
+  }
+
+  return 0;
+}
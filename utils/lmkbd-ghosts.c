@@ -0,0 +1,198 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "MatrixGhosts.h"
+
+// Run the firmware's phantom key check over made-up matrix scans, such
+// as those in matrix-traces, checking what it holds back and timing it.
+// Each line is one scan: the rows down in each column, in hex, then
+// optionally = and the rows expected to be held in each; none if left
+// out. # starts a comment. The times are for this host, good for
+// comparing one trace with another; LMKBD_PROFILE gives the cost of a
+// whole scan on the keyboard itself.
+
+#define MAX_SCANS 1024
+
+static int iterations = 100000;
+static int verbose = 0;
+
+static struct option long_options[] = {
+  {"iterations", required_argument, 0, 'n'},
+  {"verbose", no_argument, &verbose, 1},
+  {NULL, 0, 0, 0}
+};
+
+typedef struct {
+  uint8_t keys[MATRIX_GHOSTS_MAX_COLUMNS];
+  uint8_t ghosts[MATRIX_GHOSTS_MAX_COLUMNS];
+} Scan;
+
+static Scan scans[MAX_SCANS];
+
+/** Read up to max hex bytes; the number read. */
+static int parse_columns(char **line, uint8_t *columns, int max)
+{
+  int n = 0;
+  char *end;
+
+  while (n < max) {
+    unsigned long value = strtoul(*line, &end, 16);
+    if (end == *line) break;
+    columns[n++] = value;
+    *line = end;
+  }
+  return n;
+}
+
+/** Load a trace; the number of scans, or -1 after saying what is wrong. */
+static int load_trace(const char *file, int *columns)
+{
+  FILE *in = fopen(file, "r");
+  char line[256];
+  int nscans = 0, lineno = 0;
+
+  if (in == NULL) {
+    perror(file);
+    return -1;
+  }
+  *columns = 0;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    char *p = line, *comment = strchr(line, '#');
+    Scan *scan;
+    int n;
+
+    lineno++;
+    if (comment != NULL) *comment = '\0';
+    if (strspn(line, " \t\r\n") == strlen(line)) continue;
+    if (nscans >= MAX_SCANS) {
+      fprintf(stderr, "%s:%d: more than %d scans\n", file, lineno, MAX_SCANS);
+      fclose(in);
+      return -1;
+    }
+    scan = &scans[nscans];
+    memset(scan, 0, sizeof(*scan));
+    n = parse_columns(&p, scan->keys, MATRIX_GHOSTS_MAX_COLUMNS);
+    if (*columns == 0) *columns = n;
+    p += strspn(p, " \t");
+    if ((n == 0) || (n != *columns) ||
+        ((*p == '=') && (p++, parse_columns(&p, scan->ghosts, n) != n)) ||
+        (strspn(p, " \t\r\n") != strlen(p))) {
+      fprintf(stderr, "%s:%d: bad scan\n", file, lineno);
+      fclose(in);
+      return -1;
+    }
+    nscans++;
+  }
+  fclose(in);
+  return nscans;
+}
+
+static void print_columns(const char *label, const uint8_t *columns, int n)
+{
+  int i;
+
+  printf("  %-7s", label);
+  for (i = 0; i < n; i++)
+    printf(" %02X", columns[i]);
+  printf("\n");
+}
+
+/** Check and time one trace; the number of scans held wrongly, or -1. */
+static int run_trace(const char *file)
+{
+  uint8_t ghosts[MATRIX_GHOSTS_MAX_COLUMNS];
+  struct timespec start, end;
+  volatile uint8_t sink = 0;    // Keep the timed calls.
+  int columns, nscans, i, j, wrong = 0;
+  double ns;
+
+  nscans = load_trace(file, &columns);
+  if (nscans < 0) return -1;
+  if (nscans == 0) {
+    fprintf(stderr, "%s: no scans\n", file);
+    return -1;
+  }
+
+  for (i = 0; i < nscans; i++) {
+    MatrixGhosts_Find(scans[i].keys, ghosts, columns);
+    if (memcmp(ghosts, scans[i].ghosts, columns)) {
+      wrong++;
+      printf("%s: scan %d held wrongly\n", file, i + 1);
+      print_columns("keys", scans[i].keys, columns);
+      print_columns("wanted", scans[i].ghosts, columns);
+      print_columns("got", ghosts, columns);
+    }
+    else if (verbose) {
+      printf("%s: scan %d\n", file, i + 1);
+      print_columns("keys", scans[i].keys, columns);
+      print_columns("held", ghosts, columns);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (j = 0; j < iterations; j++) {
+    for (i = 0; i < nscans; i++) {
+      MatrixGhosts_Find(scans[i].keys, ghosts, columns);
+      sink ^= ghosts[0];
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  printf("%-32s %4d scans %2d columns %8.1f ns/scan\n",
+         file, nscans, columns, ns / ((double)iterations * nscans));
+  return wrong;
+}
+
+int main(int argc, char **argv)
+{
+  int wrong = 0;
+
+  while (true) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "n:v",
+                        long_options, &option_index);
+
+    if (c < 0) break;
+
+    if (c == 0) {
+      if (long_options[option_index].flag != 0) continue;
+      c = long_options[option_index].val;
+    }
+
+    switch (c) {
+    case 'n':
+      iterations = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'v':
+      verbose = 1;
+      break;
+
+    case '?':
+    default:
+      printf("Usage: %s [--iterations n] [--verbose] trace...\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if ((iterations <= 0) || (optind >= argc)) {
+    printf("Usage: %s [--iterations n] [--verbose] trace...\n", argv[0]);
+    return 1;
+  }
+
+  for (; optind < argc; optind++) {
+    int n = run_trace(argv[optind]);
+    if (n < 0) return 1;
+    wrong += n;
+  }
+  if (wrong > 0) {
+    printf("%d scans held wrongly.\n", wrong);
+    return 1;
+  }
+  return 0;
+}
@@ -4,19 +4,43 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <limits.h>
 #include <getopt.h>
 #include <libudev.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <linux/hidraw.h>
 
+#include "Trace.h"
+#include "lmkbd-bench.h"
+
 static const char *VENDOR = "23fd", *PRODUCT = "2069";
-static bool find_lmkbd(char *device)
+
+static bool is_lmkbd(struct udev_device *usbdev)
+{
+  const char *vendor = udev_device_get_sysattr_value(usbdev, "idVendor");
+  const char *product = udev_device_get_sysattr_value(usbdev, "idProduct");
+  return (vendor != NULL) && !strcmp(VENDOR, vendor) &&
+    (product != NULL) && !strcmp(PRODUCT, product);
+}
+
+/** The USB serial number, or empty for firmware without one. */
+static const char *lmkbd_serial(struct udev_device *usbdev)
+{
+  const char *serial = udev_device_get_sysattr_value(usbdev, "serial");
+  return (serial != NULL) ? serial : "";
+}
+
+/** Find the one keyboard, or the one with the given serial number. */
+static bool find_lmkbd(char *device, const char *serial)
 {
   struct udev *udev;
   struct udev_enumerate *enumerate;
   struct udev_list_entry *devices, *dev_list_entry;
+  char found_serial[64] = { 0 };
+  int found = 0;
 
   udev = udev_new();
   if (udev == NULL) {
@@ -43,13 +67,20 @@ static bool find_lmkbd(char *device)
       return false;
     }
 
-    if (!strcmp(VENDOR, udev_device_get_sysattr_value(usbdev, "idVendor")) &&
-        !strcmp(PRODUCT, udev_device_get_sysattr_value(usbdev, "idProduct"))) {
-      if (device[0] != '\0') {
-        fprintf(stderr, "Found more than one keyboard. Need to specify one.\n");
-        return false;
+    if (is_lmkbd(usbdev) &&
+        ((serial == NULL) || !strcmp(serial, lmkbd_serial(usbdev)))) {
+      if (found == 1) {
+        fprintf(stderr, "Found more than one keyboard. Need to specify one:\n");
+        fprintf(stderr, "  %s %s\n", device, found_serial);
       }
-      strncpy(device, devpath, PATH_MAX-1);
+      if (found > 0) {
+        fprintf(stderr, "  %s %s\n", devpath, lmkbd_serial(usbdev));
+      }
+      else {
+        strncpy(device, devpath, PATH_MAX-1);
+        strncpy(found_serial, lmkbd_serial(usbdev), sizeof(found_serial)-1);
+      }
+      found++;
     }
 
     udev_device_unref(hiddev);
@@ -58,39 +89,521 @@ static bool find_lmkbd(char *device)
   udev_enumerate_unref(enumerate);
   udev_unref(udev);
 
-  if (device[0] == '\0') {
+  if (found == 0) {
     fprintf(stderr, "Keyboard not found.\n");
     return false;
   }
-  return true;
+  return (found == 1);
 }
 
+// Changes to make to a keyboard's settings.
+typedef struct {
+  int mode;                     // Zero to leave alone.
+  bool swap;
+  int model;                    // Negative to leave alone.
+  int lock_mode;
+} Settings;
+
 static char device[PATH_MAX] = { 0 };
 static int swap = 0;
 static int set_mode = 0;
+static int set_model = -1;
+static int set_lock_mode = -1;
+static const char *serial = NULL;
+static int daemon_mode = 0;
+static const char *config_file = "/etc/lmkbd.conf";
+static int stats = 0;
+static int trace = 0;
+static int no_times = 0;
+static int profile = 0;
+static int reset_profile = 0;
+static int bench = 0;
+static int verbose = 0;
+static const char *record_file = NULL;
+static const char *capture_file = NULL;
 
 static struct option long_options[] = {
   {"device", required_argument, 0, 'd'},
+  {"serial", required_argument, 0, 'S'},
   {"swap", no_argument, &swap, 1},
   {"set", required_argument, 0, 's'},
+  {"model", required_argument, 0, 'm'},
+  {"lock-mode", required_argument, 0, 'l'},
+  {"stats", no_argument, &stats, 1},
+  {"trace", no_argument, &trace, 1},
+  {"no-times", no_argument, &no_times, 1},
+  {"profile", no_argument, &profile, 1},
+  {"reset-profile", no_argument, &reset_profile, 1},
+  {"bench", no_argument, &bench, 1},
+  {"record", required_argument, 0, 'r'},
+  {"capture", required_argument, 0, 'c'},
+  {"verbose", no_argument, &verbose, 1},
+  {"daemon", no_argument, &daemon_mode, 1},
+  {"config", required_argument, 0, 'C'},
   {NULL, 0, 0, 0}
 };
 
 static const char *models[] = {
-  "tk", "space_cadet", "smbx"
+  "tk", "space_cadet", "smbx", "ti"
 };
 
 static const char *modes[] = {
-  "illegal", "HUT", "Emacs"
+  "illegal", "HUT", "Emacs", "Unicode"
+};
+
+static const char *lock_modes[] = {
+  "none", "mode 2", "mode 2 silent"
 };
 
 #define countof(x) (sizeof(x)/sizeof(x[0]))
 
+// With LMKBD_STATS, the feature report ends with a page selector and
+// the page it selects.
+#define PAGE_INDEX 8
+#define PAGE_DATA 9
+#define PAGE_SIZE 32
+#define PAGE_KEYBOARD_LATENCY 0x10
+#define PAGE_MODE_LATENCY 0x20
+#define PAGE_TRACE 0x30
+#define PAGE_PROFILE 0x40
+#define PAGE_PROFILE_RESET 0x4F
+
+// In the order of the firmware's ProfileSlot.
+static const char *profile_slots[] = {
+  "tk scan", "space_cadet scan", "smbx scan", "ti scan", "MIT_Read",
+  "LMKBD_Task", "HID_Device_USBTask", "USB_USBTask"
+};
+
+// Latency buckets double from 16us (at 16MHz).
+#define N_LATENCY_BUCKETS 16
+#define LATENCY_FIRST_US 16
+
+/** The ID of the keyboard's reports, which include the feature report,
+ * or 0 if there are no report IDs (no LMKBD_CONSUMER_KEYS).
+ */
+static unsigned char feature_report_id(int fd)
+{
+  struct hidraw_report_descriptor desc;
+  int size, i, n;
+
+  if (ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0) return 0;
+  desc.size = size;
+  if (ioctl(fd, HIDIOCGRDESC, &desc) < 0) return 0;
+  // Each short item is a prefix byte giving its tag, type and size,
+  // then 0, 1, 2 or 4 bytes of data. The keyboard's Report ID is first.
+  for (i = 0; i < (int)desc.size; i += 1 + n) {
+    unsigned char prefix = desc.value[i];
+    if (prefix == 0xFE) {       // Long item.
+      n = (i + 1 < (int)desc.size) ? desc.value[i + 1] + 2 : 0;
+      continue;
+    }
+    n = ((prefix & 3) == 3) ? 4 : (prefix & 3);
+    if (((prefix & 0xFC) == 0x84) && (n > 0) && (i + 1 < (int)desc.size))
+      return desc.value[i + 1];
+  }
+  return 0;
+}
+
+/** Get the feature report into buf and change what settings asks for.
+ * Returns the size of the report, or negative after an error.
+ */
+static int configure(int fd, const Settings *settings, unsigned char *buf, int bufsize)
+{
+  bool changed = false;
+  int rc, size;
+
+  buf[0] = feature_report_id(fd);
+  rc = ioctl(fd, HIDIOCGFEATURE(bufsize), buf);
+  if (rc < 0) {
+    perror("Error getting feature report");
+    return -1;
+  }
+  // Older firmware does not have the lock mode or queue statistics.
+  if ((rc < 4) || (rc > bufsize)) {
+    fprintf(stderr, "Incorrect feature report: %d\n", rc);
+    return -1;
+  }
+  size = rc;
+
+  if (settings->mode) {
+    buf[2] = settings->mode;
+    changed = true;
+  }
+  else if (settings->swap) {
+    unsigned char tmp;
+    tmp = buf[2];
+    buf[2] = buf[3];
+    buf[3] = tmp;
+    changed = true;
+  }
+  if (settings->model >= 0) {
+    buf[1] = settings->model;
+    changed = true;
+  }
+  if (settings->lock_mode >= 0) {
+    if (size < 5) {
+      fprintf(stderr, "Firmware does not support setting lock mode.\n");
+      return -1;
+    }
+    buf[4] = settings->lock_mode;
+    changed = true;
+  }
+  if (!changed) return size;
+
+  // The keyboard saves these, so they survive being unplugged.
+  rc = ioctl(fd, HIDIOCSFEATURE(size), buf);
+  if (rc < 0) {
+    perror("Error setting feature report");
+    return -1;
+  }
+  return size;
+}
+
+static bool get_page(int fd, unsigned char *buf, int size, int page)
+{
+  int rc;
+
+  buf[PAGE_INDEX] = page;
+  rc = ioctl(fd, HIDIOCSFEATURE(size), buf);
+  if (rc < 0) {
+    perror("Error selecting statistics page");
+    return false;
+  }
+  buf[0] = feature_report_id(fd);
+  rc = ioctl(fd, HIDIOCGFEATURE(size), buf);
+  if (rc < 0) {
+    perror("Error getting statistics page");
+    return false;
+  }
+  return true;
+}
+
+/** Read the firmware's trace, which stops recording until another page is selected,
+ * or for TRACE_PAUSE_MS after the last page read. */
+static bool print_trace(int fd, unsigned char *buf, int size)
+{
+  unsigned count, entry_size, shift, per_page, i;
+  unsigned long ticks_per_second;
+  uint16_t prev = 0;
+  bool ok = true;
+
+  if (!get_page(fd, buf, size, PAGE_TRACE)) return false;
+  count = buf[PAGE_DATA+1];
+  entry_size = buf[PAGE_DATA+2];
+  shift = buf[PAGE_DATA+3];
+  ticks_per_second = buf[PAGE_DATA+4] | (buf[PAGE_DATA+5] << 8) |
+    ((unsigned long)buf[PAGE_DATA+6] << 16) | ((unsigned long)buf[PAGE_DATA+7] << 24);
+  if ((entry_size != TRACE_ENTRY_SIZE) || (ticks_per_second == 0)) {
+    fprintf(stderr, "Firmware was not built with LMKBD_TRACE.\n");
+    return false;
+  }
+  per_page = PAGE_SIZE / entry_size;
+
+  for (i = 0; i < count; i++) {
+    TraceEntry entry;
+    char line[64];
+
+    if ((i % per_page) == 0) {
+      if (!get_page(fd, buf, size, PAGE_TRACE + 1 + i / per_page)) {
+        ok = false;
+        break;
+      }
+    }
+    Trace_Unpack(buf + PAGE_DATA + (i % per_page) * entry_size, &entry);
+    Trace_Format(&entry, line, sizeof(line));
+    if (no_times) {
+      printf("%s\n", line);
+    }
+    else {
+      // Entry times wrap, so only differences mean anything.
+      double delta = (i == 0) ? 0 :
+        (double)((uint16_t)(entry.time - prev) << shift) * 1e6 / ticks_per_second;
+      printf("%+10.0fus %s\n", delta, line);
+    }
+    prev = entry.time;
+  }
+
+  // Start recording again.
+  buf[PAGE_INDEX] = 0;
+  if (ioctl(fd, HIDIOCSFEATURE(size), buf) < 0) {
+    perror("Error resuming trace");
+    return false;
+  }
+  return ok;
+}
+
+static unsigned long get_le32(const unsigned char *bytes)
+{
+  return bytes[0] | (bytes[1] << 8) |
+    ((unsigned long)bytes[2] << 16) | ((unsigned long)bytes[3] << 24);
+}
+
+static bool print_profile(int fd, unsigned char *buf, int size)
+{
+  int i;
+
+  printf("%-20s %10s %10s %10s\n", "Task", "Calls", "Mean us", "Max us");
+  for (i = 0; i < countof(profile_slots); i++) {
+    unsigned long calls, ticks, max_ticks, ticks_per_second;
+
+    if (!get_page(fd, buf, size, PAGE_PROFILE + i)) return false;
+    calls = get_le32(buf + PAGE_DATA);
+    ticks = get_le32(buf + PAGE_DATA + 4);
+    max_ticks = buf[PAGE_DATA+8] | (buf[PAGE_DATA+9] << 8);
+    ticks_per_second = get_le32(buf + PAGE_DATA + 10);
+    if (ticks_per_second == 0) {
+      fprintf(stderr, "Firmware was not built with LMKBD_PROFILE.\n");
+      return false;
+    }
+    if (calls == 0) continue;
+    printf("%-20s %10lu %10.1f %10.1f%s\n", profile_slots[i], calls,
+           (double)ticks * 1e6 / ticks_per_second / calls,
+           (double)max_ticks * 1e6 / ticks_per_second,
+           (max_ticks == 0xFFFF) ? "+" : "");
+  }
+  return true;
+}
+
+static void print_latency(const char *title, const char *name, const unsigned char *data)
+{
+  unsigned counts[N_LATENCY_BUCKETS], total = 0;
+  int i;
+
+  for (i = 0; i < N_LATENCY_BUCKETS; i++) {
+    counts[i] = data[i*2] | (data[i*2+1] << 8);
+    total += counts[i];
+  }
+  if (total == 0) return;
+
+  printf("%s %s latency (%u):\n", title, name, total);
+  for (i = 0; i < N_LATENCY_BUCKETS; i++) {
+    unsigned long limit = (unsigned long)LATENCY_FIRST_US << i;
+    if (counts[i] == 0) continue;
+    if (i < N_LATENCY_BUCKETS - 1) {
+      printf("  < %7luus %6u\n", limit, counts[i]);
+    }
+    else {
+      printf("  >=%7luus %6u\n", limit / 2, counts[i]);
+    }
+  }
+}
+
+static int lookup_name(const char *name, const char **names, int count)
+{
+  int i;
+  char *end;
+
+  for (i = 0; i < count; i++) {
+    if (!strcmp(name, names[i])) return i;
+  }
+  i = strtol(name, &end, 10);
+  if ((*end != '\0') || (i < 0) || (i >= count)) return -1;
+  return i;
+}
+
+// Daemon configuration: a serial number, or * for any keyboard not
+// otherwise listed, then the settings for it, e.g.
+//   *       model=space_cadet set=2 lock-mode=2
+//   A1B2C3  set=3
+// Only settings that come out the same however often they are applied.
+#define MAX_CONFIGS 256
+typedef struct {
+  char serial[64];
+  Settings settings;
+} DeviceConfig;
+static DeviceConfig configs[MAX_CONFIGS];
+static int nconfigs = 0;
+
+static bool load_config(const char *file)
+{
+  FILE *in;
+  char line[256];
+  int lineno = 0;
+
+  in = fopen(file, "r");
+  if (in == NULL) {
+    perror("Unable to open config");
+    return false;
+  }
+  nconfigs = 0;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    DeviceConfig *config;
+    char *token, *value;
+
+    lineno++;
+    if ((token = strchr(line, '#')) != NULL) *token = '\0';
+    token = strtok(line, " \t\r\n");
+    if (token == NULL) continue;
+    if (nconfigs >= MAX_CONFIGS) {
+      fprintf(stderr, "%s:%d: too many keyboards\n", file, lineno);
+      break;
+    }
+    config = &configs[nconfigs++];
+    strncpy(config->serial, token, sizeof(config->serial)-1);
+    config->settings.mode = 0;
+    config->settings.swap = false;
+    config->settings.model = config->settings.lock_mode = -1;
+
+    while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+      int *setting, n;
+      const char **names;
+
+      if (!strcmp(token, "swap")) {
+        // Applied on every plug, it would flip the saved modes each time.
+        fprintf(stderr, "%s:%d: swap is not allowed here; use set=\n", file, lineno);
+        fclose(in);
+        return false;
+      }
+      value = strchr(token, '=');
+      if (value != NULL) *value++ = '\0';
+      if (!strcmp(token, "set")) {
+        setting = &config->settings.mode;
+        names = modes;
+        n = countof(modes);
+      }
+      else if (!strcmp(token, "model")) {
+        setting = &config->settings.model;
+        names = models;
+        n = countof(models);
+      }
+      else if (!strcmp(token, "lock-mode")) {
+        setting = &config->settings.lock_mode;
+        names = lock_modes;
+        n = countof(lock_modes);
+      }
+      else {
+        fprintf(stderr, "%s:%d: unknown setting: %s\n", file, lineno, token);
+        continue;
+      }
+      if ((value == NULL) || ((*setting = lookup_name(value, names, n)) < 0)) {
+        fprintf(stderr, "%s:%d: bad value for %s\n", file, lineno, token);
+        fclose(in);
+        return false;
+      }
+    }
+  }
+  fclose(in);
+  return true;
+}
+
+static const DeviceConfig *find_config(const char *serial)
+{
+  const DeviceConfig *wildcard = NULL;
+  int i;
+
+  for (i = 0; i < nconfigs; i++) {
+    if (!strcmp(configs[i].serial, serial)) return &configs[i];
+    if (!strcmp(configs[i].serial, "*") && (wildcard == NULL)) wildcard = &configs[i];
+  }
+  return wildcard;
+}
+
+/** Apply the configuration for a newly seen hidraw device, if it is a keyboard. */
+static void configure_device(struct udev_device *hiddev)
+{
+  struct udev_device *usbdev;
+  const DeviceConfig *config;
+  const char *devpath, *serial;
+  unsigned char buf[PAGE_DATA + PAGE_SIZE];
+  int fd;
+
+  usbdev = udev_device_get_parent_with_subsystem_devtype(hiddev, "usb", "usb_device");
+  if ((usbdev == NULL) || !is_lmkbd(usbdev)) return;
+  devpath = udev_device_get_devnode(hiddev);
+  if (devpath == NULL) return;
+  serial = lmkbd_serial(usbdev);
+  config = find_config(serial);
+  if (config == NULL) return;
+
+  fd = open(devpath, O_RDWR|O_NONBLOCK);
+  if (fd < 0) {
+    perror(devpath);
+    return;
+  }
+  if (configure(fd, &config->settings, buf, sizeof(buf)) >= 0) {
+    printf("Configured %s (%s)\n", devpath, (serial[0] != '\0') ? serial : "no serial");
+    fflush(stdout);
+  }
+  close(fd);
+}
+
+/** Configure keyboards as they are plugged in, and any there already. */
+static int run_daemon(const char *file)
+{
+  struct udev *udev;
+  struct udev_monitor *monitor;
+  struct udev_enumerate *enumerate;
+  struct udev_list_entry *dev_list_entry;
+  struct epoll_event event;
+  int epfd;
+
+  if (!load_config(file)) return 1;
+
+  udev = udev_new();
+  if (udev == NULL) {
+    fprintf(stderr, "Cannot create udev.\n");
+    return 1;
+  }
+
+  // Start listening before looking, so that nothing is missed in between.
+  monitor = udev_monitor_new_from_netlink(udev, "udev");
+  if (monitor == NULL) {
+    fprintf(stderr, "Cannot create udev monitor.\n");
+    return 1;
+  }
+  udev_monitor_filter_add_match_subsystem_devtype(monitor, "hidraw", NULL);
+  udev_monitor_enable_receiving(monitor);
+
+  enumerate = udev_enumerate_new(udev);
+  udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+  udev_enumerate_scan_devices(enumerate);
+  udev_list_entry_foreach(dev_list_entry, udev_enumerate_get_list_entry(enumerate)) {
+    struct udev_device *hiddev;
+    hiddev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(dev_list_entry));
+    if (hiddev == NULL) continue;
+    configure_device(hiddev);
+    udev_device_unref(hiddev);
+  }
+  udev_enumerate_unref(enumerate);
+
+  epfd = epoll_create1(0);
+  if (epfd < 0) {
+    perror("Cannot create epoll");
+    return 1;
+  }
+  event.events = EPOLLIN;
+  event.data.fd = udev_monitor_get_fd(monitor);
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, event.data.fd, &event) < 0) {
+    perror("Cannot watch udev monitor");
+    return 1;
+  }
+
+  while (true) {
+    struct udev_device *hiddev;
+    const char *action;
+    int rc;
+
+    rc = epoll_wait(epfd, &event, 1, -1);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      perror("Error waiting for udev");
+      return 1;
+    }
+    // The socket is non-blocking, so take everything there is.
+    while ((hiddev = udev_monitor_receive_device(monitor)) != NULL) {
+      action = udev_device_get_action(hiddev);
+      if ((action != NULL) && !strcmp(action, "add"))
+        configure_device(hiddev);
+      udev_device_unref(hiddev);
+    }
+  }
+}
+
 int main(int argc, char **argv)
 {
   while (true) {
     int option_index = 0;
-    int c = getopt_long(argc, argv, "d:s:x",
+    int c = getopt_long(argc, argv, "d:s:xm:l:r:c:v",
                         long_options, &option_index);
 
     if (c < 0) break;
@@ -110,6 +623,10 @@ int main(int argc, char **argv)
       }
       break;
 
+    case 'S':
+      serial = optarg;
+      break;
+
     case 's':
       set_mode = strtoul(optarg, NULL, 10);
       break;
@@ -118,61 +635,136 @@ int main(int argc, char **argv)
       swap = 1;
       break;
 
+    case 'm':
+      set_model = lookup_name(optarg, models, countof(models));
+      if (set_model < 0) {
+        fprintf(stderr, "Unknown model: %s\n", optarg);
+        return 1;
+      }
+      break;
+
+    case 'l':
+      set_lock_mode = lookup_name(optarg, lock_modes, countof(lock_modes));
+      if (set_lock_mode < 0) {
+        fprintf(stderr, "Unknown lock mode: %s\n", optarg);
+        return 1;
+      }
+      break;
+
+    case 'r':
+      record_file = optarg;
+      break;
+
+    case 'c':
+      capture_file = optarg;
+      break;
+
+    case 'v':
+      verbose = 1;
+      break;
+
+    case 'C':
+      config_file = optarg;
+      break;
+
     case '?':
     default:
-      printf("Usage: %s [--device num] [--swap] [--set mode]\n", argv[0]);
+      printf("Usage: %s [--device num | --serial id] [--swap] [--set mode] [--model name] [--lock-mode num] [--stats] [--trace [--no-times]] [--profile] [--reset-profile]\n"
+             "       %s [--device num | --serial id] --bench [--record file] [--verbose]\n"
+             "       %s --capture file [--verbose]\n"
+             "       %s --daemon [--config file]\n", argv[0], argv[0], argv[0], argv[0]);
       return 1;
     }
   }
 
+  if (capture_file != NULL) {
+    FILE *in = fopen(capture_file, "r");
+    if (in == NULL) {
+      perror("Unable to open capture");
+      return 1;
+    }
+    return bench_capture(in, verbose);
+  }
+
+  if (daemon_mode) {
+    return run_daemon(config_file);
+  }
+
   if (device[0] == '\0') {
-    if (!find_lmkbd(device)) return 1;
+    if (!find_lmkbd(device, serial)) return 1;
   }
 
-  int fd, rc;
-  unsigned char buf[4];
+  int fd, rc, size;
+  unsigned char buf[PAGE_DATA + PAGE_SIZE];
   fd = open(device, O_RDWR|O_NONBLOCK);
   if (fd < 0) {
     perror("Unable to open device");
     return 1;
   }
   
-  buf[0] = 0;
-  rc = ioctl(fd, HIDIOCGFEATURE(4), buf);
-  if (rc < 0) {
-    perror("Error getting feature report");
-    return 1;
-  }
-  if (rc != 4) {
-    fprintf(stderr, "Incorrect feature report: %d", rc);
-    return 1;
+  if (bench) {
+    FILE *record = NULL;
+    if (record_file != NULL) {
+      record = fopen(record_file, "w");
+      if (record == NULL) {
+        perror("Unable to create capture");
+        return 1;
+      }
+    }
+    rc = bench_device(fd, record, verbose);
+    if (record != NULL) fclose(record);
+    return rc;
   }
 
+  Settings settings = { set_mode, swap, set_model, set_lock_mode };
+  size = configure(fd, &settings, buf, sizeof(buf));
+  if (size < 0) return 1;
+
   printf("Model = %d (%s)\n", buf[1], (buf[1] < countof(models)) ? models[buf[1]] : "unknown");
+  printf("Normal mode = %d (%s)\n", buf[2], (buf[2] < countof(modes)) ? modes[buf[2]] : "unknown");
+  printf("Mode lock mode = %d (%s)\n", buf[3], (buf[3] < countof(modes)) ? modes[buf[3]] : "unknown");
+  if (size > 4) {
+    printf("Mode lock key = %d (%s)\n", buf[4], (buf[4] < countof(lock_modes)) ? lock_modes[buf[4]] : "unknown");
+  }
+  if (size > 7) {
+    printf("Emacs queue high water = %d\n", buf[5]);
+    printf("Held key transitions high water = %d\n", buf[6]);
+    printf("Queue drops = %d\n", buf[7]);
+  }
+
+  if (stats) {
+    int i;
 
-  do {
-    if (set_mode) {
-      buf[2] = set_mode;
+    if (size < PAGE_DATA + PAGE_SIZE) {
+      fprintf(stderr, "Firmware was not built with LMKBD_STATS.\n");
+      return 1;
     }
-    else if (swap) {
-      unsigned char tmp;
-      tmp = buf[2];
-      buf[2] = buf[3];
-      buf[3] = tmp;
+    for (i = 0; i < countof(models); i++) {
+      if (!get_page(fd, buf, size, PAGE_KEYBOARD_LATENCY + i)) return 1;
+      print_latency("Keyboard", models[i], buf + PAGE_DATA);
     }
-    else {
-      break;
+    for (i = 1; i < countof(modes); i++) {
+      if (!get_page(fd, buf, size, PAGE_MODE_LATENCY + i)) return 1;
+      print_latency("Mode", modes[i], buf + PAGE_DATA);
     }
+  }
 
-    rc = ioctl(fd, HIDIOCSFEATURE(4), buf);
-    if (rc < 0) {
-      perror("Error setting feature report");
+  if (trace) {
+    if (size < PAGE_DATA + PAGE_SIZE) {
+      fprintf(stderr, "Firmware was not built with LMKBD_TRACE.\n");
       return 1;
     }
-  } while(false);
-  
-  printf("Normal mode = %d (%s)\n", buf[2], (buf[2] < countof(modes)) ? modes[buf[2]] : "unknown");
-  printf("Mode lock mode = %d (%s)\n", buf[3], (buf[3] < countof(modes)) ? modes[buf[3]] : "unknown");
+    if (!print_trace(fd, buf, size)) return 1;
+  }
+
+  if (profile || reset_profile) {
+    if (size < PAGE_DATA + PAGE_SIZE) {
+      fprintf(stderr, "Firmware was not built with LMKBD_PROFILE.\n");
+      return 1;
+    }
+    if (profile && !print_profile(fd, buf, size)) return 1;
+    if (reset_profile && !get_page(fd, buf, size, PAGE_PROFILE_RESET)) return 1;
+  }
 
   return 0;
 }
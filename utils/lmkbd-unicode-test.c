@@ -0,0 +1,309 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include "UnicodeEntry.h"
+
+#define PROGMEM
+#include "UnicodeKeysyms.h"
+
+// Check that every graphic legend the Unicode mode knows arrives as
+// the right character: make a virtual keyboard with uhid, send it the
+// firmware's Ctrl+Shift+U entry reports for each codepoint, and read
+// them back from its event device, doing the hex entry here as GTK or
+// IBus would. The device is grabbed, so nothing is typed anywhere.
+// Needs write access to /dev/uhid (usually root).
+
+#define DEVICE_NAME "lmkbd unicode test"
+#define REPORT_SIZE 8
+#define EVENT_TIMEOUT_MS 500
+
+static int verbose = 0;
+
+static struct option long_options[] = {
+  {"verbose", no_argument, &verbose, 1},
+  {NULL, 0, 0, 0}
+};
+
+// The boot keyboard input report: modifiers, reserved, six keys.
+static const unsigned char report_descriptor[] = {
+  0x05, 0x01,                   // Usage Page (Generic Desktop)
+  0x09, 0x06,                   // Usage (Keyboard)
+  0xA1, 0x01,                   // Collection (Application)
+  0x05, 0x07,                   //   Usage Page (Key Codes)
+  0x19, 0xE0,                   //   Usage Minimum (224)
+  0x29, 0xE7,                   //   Usage Maximum (231)
+  0x15, 0x00,                   //   Logical Minimum (0)
+  0x25, 0x01,                   //   Logical Maximum (1)
+  0x75, 0x01,                   //   Report Size (1)
+  0x95, 0x08,                   //   Report Count (8)
+  0x81, 0x02,                   //   Input (Data, Variable, Absolute)
+  0x95, 0x01,                   //   Report Count (1)
+  0x75, 0x08,                   //   Report Size (8)
+  0x81, 0x01,                   //   Input (Constant)
+  0x95, 0x06,                   //   Report Count (6)
+  0x75, 0x08,                   //   Report Size (8)
+  0x15, 0x00,                   //   Logical Minimum (0)
+  0x25, 0xFF,                   //   Logical Maximum (255)
+  0x05, 0x07,                   //   Usage Page (Key Codes)
+  0x19, 0x00,                   //   Usage Minimum (0)
+  0x29, 0xFF,                   //   Usage Maximum (255)
+  0x81, 0x00,                   //   Input (Data, Array)
+  0xC0                          // End Collection
+};
+
+static bool uhid_write(int fd, const struct uhid_event *event)
+{
+  if (write(fd, event, sizeof(*event)) != sizeof(*event)) {
+    perror("uhid write");
+    return false;
+  }
+  return true;
+}
+
+static bool uhid_create(int fd)
+{
+  struct uhid_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.type = UHID_CREATE2;
+  strcpy((char *)event.u.create2.name, DEVICE_NAME);
+  event.u.create2.rd_size = sizeof(report_descriptor);
+  event.u.create2.bus = BUS_USB;
+  memcpy(event.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+  if (!uhid_write(fd, &event)) return false;
+
+  // The kernel starts the device once it has parsed the descriptor.
+  while (true) {
+    if (read(fd, &event, sizeof(event)) < 0) {
+      perror("uhid read");
+      return false;
+    }
+    if (event.type == UHID_START) return true;
+  }
+}
+
+static bool uhid_report(int fd, uint8_t modifier, uint8_t key)
+{
+  struct uhid_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.type = UHID_INPUT2;
+  event.u.input2.size = REPORT_SIZE;
+  event.u.input2.data[0] = modifier;
+  event.u.input2.data[2] = key;
+  return uhid_write(fd, &event);
+}
+
+/** Open and grab the event device the kernel made for it. */
+static int open_event_device(void)
+{
+  int tries;
+
+  for (tries = 0; tries < 40; tries++) {
+    DIR *dir = opendir("/dev/input");
+    struct dirent *entry;
+
+    while ((dir != NULL) && ((entry = readdir(dir)) != NULL)) {
+      char path[300], name[256];
+      int fd;
+
+      if (strncmp(entry->d_name, "event", 5)) continue;
+      snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+      fd = open(path, O_RDONLY|O_NONBLOCK);
+      if (fd < 0) continue;
+      if ((ioctl(fd, EVIOCGNAME(sizeof(name)), name) >= 0) &&
+          !strcmp(name, DEVICE_NAME) &&
+          (ioctl(fd, EVIOCGRAB, 1) >= 0)) {
+        closedir(dir);
+        return fd;
+      }
+      close(fd);
+    }
+    if (dir != NULL) closedir(dir);
+    usleep(50000);
+  }
+  fprintf(stderr, "No event device for %s\n", DEVICE_NAME);
+  return -1;
+}
+
+static int hex_digit(int code)
+{
+  switch (code) {
+  case KEY_0: return 0x0;
+  case KEY_1: return 0x1;
+  case KEY_2: return 0x2;
+  case KEY_3: return 0x3;
+  case KEY_4: return 0x4;
+  case KEY_5: return 0x5;
+  case KEY_6: return 0x6;
+  case KEY_7: return 0x7;
+  case KEY_8: return 0x8;
+  case KEY_9: return 0x9;
+  case KEY_A: return 0xA;
+  case KEY_B: return 0xB;
+  case KEY_C: return 0xC;
+  case KEY_D: return 0xD;
+  case KEY_E: return 0xE;
+  case KEY_F: return 0xF;
+  default: return -1;
+  }
+}
+
+// Ctrl+Shift+U hex entry, as the input method does it.
+typedef struct {
+  bool control, shift;
+  bool entering;
+  long code;
+} HexEntry;
+
+/** Take a key press or release; the character, once entered, or -1. */
+static long hex_entry_key(HexEntry *entry, int code, int value)
+{
+  int digit;
+
+  switch (code) {
+  case KEY_LEFTCTRL:
+  case KEY_RIGHTCTRL:
+    entry->control = (value != 0);
+    return -1;
+  case KEY_LEFTSHIFT:
+  case KEY_RIGHTSHIFT:
+    entry->shift = (value != 0);
+    return -1;
+  }
+  if (value != 1) return -1;    // Only presses, not releases or repeats.
+
+  if ((code == KEY_U) && entry->control && entry->shift) {
+    entry->entering = true;
+    entry->code = 0;
+  }
+  else if (entry->entering && (code == KEY_SPACE)) {
+    entry->entering = false;
+    return entry->code;
+  }
+  else if (entry->entering && ((digit = hex_digit(code)) >= 0)) {
+    entry->code = (entry->code << 4) | digit;
+  }
+  else {
+    entry->entering = false;
+  }
+  return -1;
+}
+
+/** Send the reports the firmware would for code, ending with no keys. */
+static bool send_entry(int fd, uint16_t code)
+{
+  uint8_t stage = 0, prev_key = 0, modifier, key;
+
+  while (UnicodeEntry_Next(code, &stage, prev_key, &modifier, &key)) {
+    if (!uhid_report(fd, modifier, key)) return false;
+    prev_key = key;
+  }
+  return uhid_report(fd, 0, 0);
+}
+
+/** The next character entered on the event device, or -1 if none. */
+static long read_entry(int fd, HexEntry *entry)
+{
+  struct input_event event;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  long ch;
+
+  while (true) {
+    ssize_t n = read(fd, &event, sizeof(event));
+    if (n == sizeof(event)) {
+      if (event.type != EV_KEY) continue;
+      ch = hex_entry_key(entry, event.code, event.value);
+      if (ch >= 0) return ch;
+      continue;
+    }
+    if ((n < 0) && (errno != EAGAIN)) {
+      perror("event read");
+      return -1;
+    }
+    if (poll(&pfd, 1, EVENT_TIMEOUT_MS) <= 0)
+      return -1;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *name = UnicodeKeysymNames;
+  HexEntry entry;
+  struct uhid_event destroy;
+  int uhid, input, index, shifted;
+  int count = 0, wrong = 0;
+
+  while (true) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "v",
+                        long_options, &option_index);
+
+    if (c < 0) break;
+
+    switch (c) {
+    case 0:
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      printf("Usage: %s [--verbose]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  uhid = open("/dev/uhid", O_RDWR|O_CLOEXEC);
+  if (uhid < 0) {
+    perror("/dev/uhid");
+    return 1;
+  }
+  if (!uhid_create(uhid)) return 1;
+  input = open_event_device();
+  if (input < 0) return 1;
+
+  memset(&entry, 0, sizeof(entry));
+  for (index = 0; index < sizeof(UnicodeKeysymCodes) / sizeof(UnicodeKeysymCodes[0]); index++) {
+    for (shifted = 0; shifted < 2; shifted++) {
+      uint16_t code = UnicodeKeysymCodes[index][shifted];
+      long ch;
+
+      if (code == 0) continue;
+      if (!send_entry(uhid, code)) return 1;
+      ch = read_entry(input, &entry);
+      count++;
+      if (ch != code) {
+        wrong++;
+        if (ch < 0)
+          printf("%s%s: sent U+%04X, got nothing\n", shifted ? "shift-" : "", name, code);
+        else
+          printf("%s%s: sent U+%04X, got U+%04lX\n", shifted ? "shift-" : "", name, code, ch);
+      }
+      else if (verbose) {
+        printf("%s%s: U+%04X\n", shifted ? "shift-" : "", name, code);
+      }
+    }
+    name += strlen(name) + 1;
+  }
+
+  memset(&destroy, 0, sizeof(destroy));
+  destroy.type = UHID_DESTROY;
+  uhid_write(uhid, &destroy);
+  close(input);
+  close(uhid);
+
+  printf("%d characters, %d wrong.\n", count, wrong);
+  return (wrong > 0) ? 1 : 0;
+}